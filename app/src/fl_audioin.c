@@ -1,5 +1,6 @@
 #include "fl_common.h"
 #include "fl_audioin.h"
+#include "fl_audioin_capture.h"
 
 #include "zephyr.h"
 #include <drivers/adc.h>
@@ -7,6 +8,8 @@
 #include <drivers/dma/dma_stm32.h>
 #include <device.h>
 
+#if defined(CONFIG_FEELIGHTS_AUDIO_ADC)
+
 #include "stm32f4xx_ll_adc.h"
 #include "stm32f4xx_ll_bus.h"
 #include "stm32f4xx_ll_dma.h"
@@ -24,9 +27,11 @@ internal inline void EnableAdcChannel(ADC_TypeDef* Adc, u32 Channel, u32 Rank);
 internal inline void StartAdc(ADC_TypeDef* Adc);
 internal inline void StopAdc(ADC_TypeDef* Adc);
 internal void AdcConfig(ADC_TypeDef* Adc, uint32_t TimerTriggerId, uint32_t AdcPeriphId);
-internal void Adc3Init(u16* Data, u32 BufferSize);
+internal void Adc3Init(u16* Data, u32 NumSamples);
 
 #define DMA_NODE		DT_ALIAS(mic_dma)
+#define DMA_CHANNEL 1
+#define DMA_STREAM LL_DMA_STREAM_1
 internal const struct device *DmaDevice = DEVICE_DT_GET(DMA_NODE);
 
 internal void TIM2IrqHandler()
@@ -59,13 +64,13 @@ internal void ADCIrqHandler()
    }
 }
 
-u32 AudioInInit(u16* Buffer, u32 BufferSize)
+int AudioInInit(u16* Buffer, u32 NumSamples)
 {
    // Timer config 
    u32 Tim2ClockFrequency = 200000;
-   u32 SamplingFrequency = 40000;
+   u32 SamplingFrequency = AUDIOIN_SAMPLING_FREQUENCY;
    u32 TimerClock = CONFIG_SYS_CLOCK_HW_CYCLES_PER_SEC / 4;
-   u32 Result = 0;
+   int Result = 0;
 
    LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_TIM2);
    LL_TIM_SetPrescaler(TIM2, __LL_TIM_CALC_PSC(TimerClock, Tim2ClockFrequency));
@@ -74,7 +79,9 @@ u32 AudioInInit(u16* Buffer, u32 BufferSize)
    IRQ_CONNECT(TIM2_IRQn, 0, TIM2IrqHandler, NULL, 0);
    irq_enable(TIM2_IRQn);
 
-   Adc3Init(Buffer, BufferSize);
+   AudioCaptureInit(Buffer, NumSamples);
+
+   Adc3Init(Buffer, NumSamples);
 
    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_GPIOF);
    LL_GPIO_SetPinMode(GPIOF, LL_GPIO_PIN_10, LL_GPIO_MODE_ANALOG);
@@ -85,9 +92,11 @@ u32 AudioInInit(u16* Buffer, u32 BufferSize)
    return Result;
 }
 
-u32 AudioInStart()
+int AudioInStart()
 {
-   int ReturnCode = dma_start(DmaDevice, 1);
+   AudioCaptureResume();
+
+   int ReturnCode = dma_start(DmaDevice, DMA_CHANNEL);
    if (ReturnCode != 0)
    {
       LOG_ERR("Dma start failed %d", ReturnCode);
@@ -100,12 +109,12 @@ u32 AudioInStart()
    return ReturnCode;
 }
 
-u32 AudioInStop()
+int AudioInStop()
 {
    LL_TIM_DisableCounter(TIM2);
    StopAdc(ADC3);
 
-   int ReturnCode = dma_stop(DmaDevice, 1);
+   int ReturnCode = dma_stop(DmaDevice, DMA_CHANNEL);
    if (ReturnCode != 0)
    {
       LOG_ERR("Dma stop failed %d", ReturnCode);
@@ -116,10 +125,27 @@ u32 AudioInStop()
 
 internal void DmaCallback(const struct device *Dev, void *UserData, uint32_t Channel, int Status)
 {
-   EventEmit(EV_AUDIO_SAMPLES_AVAILABLE);
+   struct dma_status DmaStatus;
+   u32 Half = 1;
+
+   if (Status < 0)
+   {
+      LOG_ERR("Dma transfer error %d", Status);
+      return;
+   }
+
+   /* The data counter reloads on transfer complete, so while it is in the
+    * lower half the DMA is filling the second half and the first one is ready */
+   if ((dma_get_status(Dev, Channel, &DmaStatus) == 0) &&
+       (DmaStatus.pending_length <= AudioCaptureHalfSize()))
+   {
+      Half = 0;
+   }
+
+   AudioCaptureAnnounce(Half);
 }
 
-internal void AdcDmaConfig(u16* Data, u32 BufferSize)
+internal void AdcDmaConfig(u16* Data, u32 NumSamples)
 {
    int ReturnCode = 0;
 
@@ -130,7 +156,7 @@ internal void AdcDmaConfig(u16* Data, u32 BufferSize)
       .dest_scatter_interval = 0,
       .dest_scatter_count = 0,
       .source_gather_count = 0,
-      .block_size = BufferSize,
+      .block_size = NumSamples * sizeof(u16),
       .next_block = NULL,
       .source_gather_en = 0,
       .dest_scatter_en = 0,
@@ -162,12 +188,15 @@ internal void AdcDmaConfig(u16* Data, u32 BufferSize)
       .head_block = &BlockConfig,
    };
 
-   ReturnCode = dma_config(DmaDevice, 1, &DevConfig);
+   ReturnCode = dma_config(DmaDevice, DMA_CHANNEL, &DevConfig);
    if (ReturnCode != 0)
    {
       LOG_ERR("Dma config failed %d", ReturnCode);
    }
 
+   /* Ping-pong: interrupt on both halves of the circular buffer */
+   LL_DMA_EnableIT_HT(DMA2, DMA_STREAM);
+
 }
 
 #if 0
@@ -340,9 +369,9 @@ internal void AdcConfig(
    LL_ADC_EnableIT_OVR(Adc);
 }
 
-internal void Adc3Init(u16* Data, u32 BufferSize)
+internal void Adc3Init(u16* Data, u32 NumSamples)
 {
-   AdcDmaConfig(Data, BufferSize);
+   AdcDmaConfig(Data, NumSamples);
 
    AdcConfig(ADC3, LL_ADC_REG_TRIG_EXT_TIM2_TRGO, LL_APB2_GRP1_PERIPH_ADC3);
 
@@ -351,3 +380,5 @@ internal void Adc3Init(u16* Data, u32 BufferSize)
    // Set timer the trigger output (TRGO)
    LL_TIM_SetTriggerOutput(TIM2, LL_TIM_TRGO_UPDATE);
 }
+
+#endif
@@ -3,9 +3,38 @@
 
 #include "fl_common.h"
 #include "fl_events.h"
+#include <stdbool.h>
 
-u32 AudioInInit(u16* Buffer, u32 BufferSize);
-u32 AudioInStart();
-u32 AudioInStop();
+#define AUDIOIN_SAMPLING_FREQUENCY (40000)
+
+/* One half of the capture ring, as handed over by the DMA half/complete interrupt */
+typedef struct {
+   u16 *Samples;
+   u32 NumSamples;
+   u32 Half;
+   u32 Sequence;
+} fl_audio_frame;
+
+typedef struct {
+   u32 FramesCaptured;
+   u32 FramesProcessed;
+   u32 FramesMissed;
+   u32 FramesTorn;
+} fl_audio_stats;
+
+/* NumSamples is the size of the whole ring, each frame is half of it.
+ * These return 0 or a negative errno code */
+int AudioInInit(u16* Buffer, u32 NumSamples);
+int AudioInStart();
+int AudioInStop();
+
+/* Claims the frame announced by an EV_AUDIO_SAMPLES_AVAILABLE message, frames
+ * skipped since the last claimed one are counted as missed */
+bool AudioInGetFrame(const fl_event_message *Message, fl_audio_frame *Frame);
+
+/* Returns false if the DMA started overwriting the frame before it was released */
+bool AudioInReleaseFrame(fl_audio_frame *Frame);
+
+void AudioInGetStats(fl_audio_stats *Stats);
 
 #endif // FL_AUDIOIN_H__
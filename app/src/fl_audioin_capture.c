@@ -0,0 +1,86 @@
+#include "fl_common.h"
+#include "fl_audioin.h"
+#include "fl_audioin_capture.h"
+
+internal struct
+{
+   u16 *Buffer;
+   u32 HalfSize;
+   /* Written only by the source */
+   volatile u32 LastSequence;
+   u32 LastClaimed;
+   fl_audio_stats Stats;
+} Capture;
+
+void AudioCaptureInit(u16 *Buffer, u32 NumSamples)
+{
+   Capture.Buffer = Buffer;
+   Capture.HalfSize = NumSamples / 2;
+}
+
+u32 AudioCaptureHalfSize()
+{
+   return Capture.HalfSize;
+}
+
+u32 AudioCaptureSequence()
+{
+   return Capture.LastSequence;
+}
+
+void AudioCaptureResume()
+{
+   Capture.LastClaimed = Capture.LastSequence;
+}
+
+void AudioCaptureAnnounce(u32 Half)
+{
+   Capture.LastSequence++;
+
+   fl_event_message Message = {
+      .Type = EV_AUDIO_SAMPLES_AVAILABLE,
+      .Audio.Half = Half,
+      .Audio.Sequence = Capture.LastSequence,
+   };
+   EventEmit(&Message);
+}
+
+bool AudioInGetFrame(const fl_event_message *Message, fl_audio_frame *Frame)
+{
+   u32 Sequence = Message->Audio.Sequence;
+   u32 Half = Message->Audio.Half;
+
+   if ((i32)(Sequence - Capture.LastClaimed) <= 0)
+   {
+      return false;
+   }
+
+   Capture.Stats.FramesMissed += Sequence - Capture.LastClaimed - 1;
+   Capture.LastClaimed = Sequence;
+
+   Frame->Samples = Capture.Buffer + Half * Capture.HalfSize;
+   Frame->NumSamples = Capture.HalfSize;
+   Frame->Half = Half;
+   Frame->Sequence = Sequence;
+
+   return true;
+}
+
+bool AudioInReleaseFrame(fl_audio_frame *Frame)
+{
+   /* Once the next half is complete the source is writing into this one again */
+   if (Capture.LastSequence != Frame->Sequence)
+   {
+      Capture.Stats.FramesTorn++;
+      return false;
+   }
+
+   Capture.Stats.FramesProcessed++;
+   return true;
+}
+
+void AudioInGetStats(fl_audio_stats *Stats)
+{
+   *Stats = Capture.Stats;
+   Stats->FramesCaptured = Capture.LastSequence;
+}
@@ -0,0 +1,21 @@
+#ifndef FL_AUDIOIN_CAPTURE_H__
+#define FL_AUDIOIN_CAPTURE_H__
+
+#include "fl_common.h"
+
+/* Frame bookkeeping shared by the audio sources, which only fill the halves
+ * of the ring and announce each one once it is complete */
+void AudioCaptureInit(u16 *Buffer, u32 NumSamples);
+
+u32 AudioCaptureHalfSize();
+
+/* Frames announced so far */
+u32 AudioCaptureSequence();
+
+/* Whatever happened while stopped is not a missed frame */
+void AudioCaptureResume();
+
+/* From the interrupt or thread that filled the half */
+void AudioCaptureAnnounce(u32 Half);
+
+#endif // FL_AUDIOIN_CAPTURE_H__
@@ -0,0 +1,259 @@
+#include "fl_common.h"
+#include "fl_audioin.h"
+#include "fl_audioin_capture.h"
+
+#include "zephyr.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(CONFIG_FEELIGHTS_AUDIO_FILE)
+
+/* native_posix command line and exit */
+#include "soc.h"
+#include "cmdline.h"
+#include "posix_board_if.h"
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(audioin_file);
+
+/* Stands in for the DMA interrupt, above every application thread */
+#define FEED_PRIORITY K_PRIO_COOP(1)
+/* The ADC reads the biased microphone as 12 bit unsigned samples */
+#define ADC_MIDPOINT (2048)
+#define RESAMPLE_ONE (1u << 16)
+
+internal char *AudioPath = CONFIG_FEELIGHTS_AUDIO_FILE_PATH;
+internal bool AudioLoop;
+
+internal struct args_struct_t AudioOptions[] = {
+   { .option = "audio", .name = "path", .type = 's', .dest = (void *)&AudioPath,
+     .descript = "WAV (16 bit PCM) or raw 16 bit mono PCM file played into the audio capture" },
+   { .is_switch = true, .option = "audio-loop", .type = 'b', .dest = (void *)&AudioLoop,
+     .descript = "Start the audio file over at its end instead of exiting" },
+   ARG_TABLE_ENDMARKER
+};
+
+internal void AddAudioOptions()
+{
+   native_add_command_line_opts(AudioOptions);
+}
+NATIVE_TASK(AddAudioOptions, PRE_BOOT_1, 10);
+
+internal struct
+{
+   FILE *File;
+   long DataStart;
+   u32 Channels;
+   u32 Rate;
+   /* File frames per captured sample in 1/65536, with the position between
+    * the Previous and Next file frames */
+   u32 Step;
+   u32 Phase;
+   i32 Previous;
+   i32 Next;
+} Source;
+
+internal u16 *Buffer;
+internal u32 NextHalf;
+
+internal struct k_timer FeedTimer;
+internal struct k_sem FeedSignal;
+internal struct k_thread FeedThread;
+internal K_THREAD_STACK_DEFINE(FeedStack, 1024);
+
+internal inline u32 ReadLe(const u8 *Bytes, u32 Count)
+{
+   u32 Value = 0;
+
+   for (u32 I = 0; I < Count; ++I)
+   {
+      Value |= (u32)Bytes[I] << (8 * I);
+   }
+
+   return Value;
+}
+
+/* Leaves the file at the start of the samples, anything without a RIFF
+ * header is taken as raw mono PCM at the capture rate */
+internal int OpenSource(const char *Path)
+{
+   u8 Header[12];
+   u8 Chunk[8];
+   u8 Format[16];
+
+   Source.File = fopen(Path, "rb");
+   if (Source.File == NULL)
+   {
+      LOG_ERR("Can't open audio file %s", Path);
+      return -errno;
+   }
+
+   Source.Channels = 1;
+   Source.Rate = AUDIOIN_SAMPLING_FREQUENCY;
+   Source.DataStart = 0;
+
+   if ((fread(Header, 1, sizeof(Header), Source.File) != sizeof(Header)) ||
+       (memcmp(Header, "RIFF", 4) != 0) || (memcmp(Header + 8, "WAVE", 4) != 0))
+   {
+      LOG_INF("Playing %s as raw 16 bit mono PCM at %u Hz", Path, Source.Rate);
+      fseek(Source.File, 0, SEEK_SET);
+      return 0;
+   }
+
+   while (fread(Chunk, 1, sizeof(Chunk), Source.File) == sizeof(Chunk))
+   {
+      u32 Size = ReadLe(Chunk + 4, 4);
+
+      if (memcmp(Chunk, "fmt ", 4) == 0 && Size >= sizeof(Format))
+      {
+         if (fread(Format, 1, sizeof(Format), Source.File) != sizeof(Format))
+         {
+            break;
+         }
+         /* 1 is PCM, 0xFFFE the extensible header used for more channels */
+         u32 Tag = ReadLe(Format, 2);
+         u32 Bits = ReadLe(Format + 14, 2);
+         if ((Tag != 1 && Tag != 0xFFFE) || Bits != 16)
+         {
+            LOG_ERR("%s is not 16 bit PCM (format %u, %u bits)", Path, Tag, Bits);
+            return -ENOTSUP;
+         }
+         Source.Channels = ReadLe(Format + 2, 2);
+         Source.Rate = ReadLe(Format + 4, 4);
+         Size -= sizeof(Format);
+      }
+      else if (memcmp(Chunk, "data", 4) == 0)
+      {
+         Source.DataStart = ftell(Source.File);
+         LOG_INF("Playing %s, %u channels at %u Hz", Path, Source.Channels, Source.Rate);
+         return (Source.Channels > 0 && Source.Rate > 0) ? 0 : -EINVAL;
+      }
+
+      /* Chunks are padded to an even size */
+      fseek(Source.File, Size + (Size & 1), SEEK_CUR);
+   }
+
+   LOG_ERR("No samples in %s", Path);
+   return -EINVAL;
+}
+
+/* Mixes one frame of the file down to mono, false at its end */
+internal bool ReadFrame(i32 *Value)
+{
+   u8 Bytes[2];
+   i32 Sum = 0;
+
+   for (u32 C = 0; C < Source.Channels; ++C)
+   {
+      if (fread(Bytes, 1, sizeof(Bytes), Source.File) != sizeof(Bytes))
+      {
+         if (!AudioLoop || C != 0 || fseek(Source.File, Source.DataStart, SEEK_SET) != 0 ||
+             fread(Bytes, 1, sizeof(Bytes), Source.File) != sizeof(Bytes))
+         {
+            return false;
+         }
+      }
+      Sum += (i16)ReadLe(Bytes, 2);
+   }
+
+   *Value = Sum / (i32)Source.Channels;
+   return true;
+}
+
+/* Linear interpolation between file frames brings any rate to the capture one */
+internal bool FillHalf(u16 *Samples, u32 NumSamples)
+{
+   for (u32 I = 0; I < NumSamples; ++I)
+   {
+      i32 Delta = Source.Next - Source.Previous;
+      i32 Value = Source.Previous + (i32)(((i64)Delta * Source.Phase) >> 16);
+
+      Samples[I] = (u16)(ADC_MIDPOINT + (Value >> 4));
+
+      for (Source.Phase += Source.Step; Source.Phase >= RESAMPLE_ONE; Source.Phase -= RESAMPLE_ONE)
+      {
+         Source.Previous = Source.Next;
+         if (!ReadFrame(&Source.Next))
+         {
+            return false;
+         }
+      }
+   }
+
+   return true;
+}
+
+internal void FeedTimerExpired(struct k_timer *Timer)
+{
+   k_sem_give(&FeedSignal);
+}
+
+/* Fills the halves in the same order and at the same pace as the DMA would */
+internal void FeedLoop(void *P1, void *P2, void *P3)
+{
+   while (true)
+   {
+      k_sem_take(&FeedSignal, K_FOREVER);
+
+      u32 Half = NextHalf;
+      u32 HalfSize = AudioCaptureHalfSize();
+      if (!FillHalf(Buffer + Half * HalfSize, HalfSize))
+      {
+         LOG_INF("End of audio after %u frames", AudioCaptureSequence());
+         posix_exit(0);
+      }
+      NextHalf ^= 1;
+
+      AudioCaptureAnnounce(Half);
+   }
+}
+
+int AudioInInit(u16* Samples, u32 NumSamples)
+{
+   Buffer = Samples;
+   AudioCaptureInit(Samples, NumSamples);
+   memset(Samples, 0, NumSamples * sizeof(*Samples));
+
+   int ReturnCode = OpenSource(AudioPath);
+   if (ReturnCode != 0)
+   {
+      return ReturnCode;
+   }
+
+   Source.Step = (u32)(((u64)Source.Rate << 16) / AUDIOIN_SAMPLING_FREQUENCY);
+   Source.Phase = 0;
+   if (!ReadFrame(&Source.Previous) || !ReadFrame(&Source.Next))
+   {
+      LOG_ERR("Audio file %s is too short", AudioPath);
+      return -EINVAL;
+   }
+
+   k_sem_init(&FeedSignal, 0, 1);
+   k_timer_init(&FeedTimer, FeedTimerExpired, NULL);
+   k_thread_create(&FeedThread, FeedStack, K_THREAD_STACK_SIZEOF(FeedStack),
+         FeedLoop, NULL, NULL, NULL, FEED_PRIORITY, 0, K_NO_WAIT);
+   k_thread_name_set(&FeedThread, "audio_feed");
+
+   return 0;
+}
+
+int AudioInStart()
+{
+   AudioCaptureResume();
+
+   k_timeout_t Period = K_USEC((u64)AudioCaptureHalfSize() * 1000000 / AUDIOIN_SAMPLING_FREQUENCY);
+   k_timer_start(&FeedTimer, Period, Period);
+
+   return 0;
+}
+
+int AudioInStop()
+{
+   k_timer_stop(&FeedTimer);
+
+   return 0;
+}
+
+#endif
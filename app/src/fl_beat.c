@@ -0,0 +1,287 @@
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+#include "fl_beat.h"
+#include "fl_memory.h"
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(beat);
+
+#define BEAT_MAX_BANDS (64)
+
+/* Onsets are summed over a few frames so the tempo lags stay in a fixed range
+ * whatever the hop size */
+#define ONSET_RATE (80.0f)
+#define ONSET_HISTORY (256)
+#define ONSET_HISTORY_MASK (ONSET_HISTORY - 1)
+#define ONSET_COMPRESSION (1000.0f)
+#define ONSET_MEAN_SECONDS (1.0f)
+
+#define MIN_BPM (60.0f)
+#define MAX_BPM (180.0f)
+/* Tempo prior, centred on a typical dance tempo and about an octave wide */
+#define PRIOR_BPM (120.0f)
+#define PRIOR_OCTAVES (0.9f)
+#define ACF_SECONDS (8.0f)
+/* Weight of the second period in the comb, favours the real beat over its half */
+#define ACF_HARMONIC (0.5f)
+/* Bonus for periods close to the current one, so the tempo does not flip between octaves */
+#define TEMPO_STICKINESS (1.3f)
+
+#define PLL_GAIN (0.15f)
+#define PLL_MAX_CORRECTION (0.05f)
+/* Onset peaks have to stand out from the average and from the recent loudest peak */
+#define PEAK_RATIO (1.5f)
+#define PEAK_SHARE (0.3f)
+#define PEAK_HOLD_SECONDS (2.0f)
+#define BAR_ACCENT_DECAY (0.9f)
+#define BEATS_PER_BAR (4)
+
+internal struct
+{
+   u32 NumBands;
+   u32 Decimation;
+   f32 OnsetRate;
+   u32 MinLag;
+   u32 MaxLag;
+   f32 MeanAlpha;
+   f32 AcfDecay;
+   f32 PeakDecay;
+
+   f32 PrevBands[BEAT_MAX_BANDS];
+   f32 FluxSum;
+   u32 FluxCount;
+   f32 OnsetMean;
+   f32 NoveltyMean;
+   f32 PeakLevel;
+
+   f32 Novelty[ONSET_HISTORY];
+   u32 Head;
+   f32 Acf[ONSET_HISTORY];
+   f32 AcfEnergy;
+   f32 Prior[ONSET_HISTORY];
+
+   f32 Period;
+   f32 Phase;
+   u32 BeatCount;
+   f32 BarAccent[BEATS_PER_BAR];
+   u32 DownbeatSlot;
+   f32 Confidence;
+
+   fl_beat_stats Stats;
+} Tracker FL_CCM;
+
+int BeatInit(f32 FrameRate, u32 NumBands)
+{
+   if (NumBands > BEAT_MAX_BANDS || FrameRate <= 0.0f)
+   {
+      LOG_ERR("Unsupported beat tracker setup %u bands", NumBands);
+      return -EINVAL;
+   }
+
+   memset(&Tracker, 0, sizeof(Tracker));
+   Tracker.NumBands = NumBands;
+   Tracker.Decimation = Maximum(Round(FrameRate / ONSET_RATE), 1);
+   Tracker.OnsetRate = FrameRate / (f32)Tracker.Decimation;
+   Tracker.MinLag = (u32)(60.0f * Tracker.OnsetRate / MAX_BPM);
+   Tracker.MaxLag = Minimum((u32)(60.0f * Tracker.OnsetRate / MIN_BPM) + 1, ONSET_HISTORY / 2 - 2);
+   Tracker.MeanAlpha = 1.0f / (ONSET_MEAN_SECONDS * Tracker.OnsetRate);
+   Tracker.AcfDecay = expf(-1.0f / (ACF_SECONDS * Tracker.OnsetRate));
+   Tracker.PeakDecay = expf(-1.0f / (PEAK_HOLD_SECONDS * Tracker.OnsetRate));
+
+   for (u32 Lag = Tracker.MinLag; Lag <= Tracker.MaxLag; ++Lag)
+   {
+      f32 Octaves = log2f(60.0f * Tracker.OnsetRate / (f32)Lag / PRIOR_BPM) / PRIOR_OCTAVES;
+      Tracker.Prior[Lag] = expf(-0.5f * Octaves * Octaves);
+   }
+
+   Tracker.Period = 60.0f * Tracker.OnsetRate / PRIOR_BPM;
+
+   return 0;
+}
+
+/* Half-wave rectified rise of the log compressed band energies */
+internal f32 SpectralFlux(const f32 *Bands)
+{
+   f32 Flux = 0.0f;
+
+   for (u32 I = 0; I < Tracker.NumBands; ++I)
+   {
+      f32 Level = logf(1.0f + ONSET_COMPRESSION * Bands[I]);
+      f32 Rise = Level - Tracker.PrevBands[I];
+      Flux += Rise > 0.0f ? Rise : 0.0f;
+      Tracker.PrevBands[I] = Level;
+   }
+
+   return Flux / (f32)Tracker.NumBands;
+}
+
+internal inline f32 NoveltyAgo(u32 Ticks)
+{
+   return Tracker.Novelty[(Tracker.Head - Ticks) & ONSET_HISTORY_MASK];
+}
+
+/* One more term for every lag of the leaky autocorrelation, then pick the
+ * period whose comb of two beats is strongest under the tempo prior */
+internal void UpdateTempo(f32 Novelty)
+{
+   f32 Best = 0.0f;
+   u32 BestLag = 0;
+
+   for (u32 Lag = Tracker.MinLag; Lag <= 2 * Tracker.MaxLag + 1; ++Lag)
+   {
+      Tracker.Acf[Lag] = Tracker.AcfDecay * Tracker.Acf[Lag] + Novelty * NoveltyAgo(Lag);
+   }
+
+   for (u32 Lag = Tracker.MinLag; Lag <= Tracker.MaxLag; ++Lag)
+   {
+      f32 Comb = Tracker.Acf[Lag] + ACF_HARMONIC * Maximum(Tracker.Acf[2 * Lag], Tracker.Acf[2 * Lag + 1]);
+      f32 Weighted = Comb * Tracker.Prior[Lag];
+      if (Abs((f32)Lag - Tracker.Period) < 0.1f * Tracker.Period)
+      {
+         Weighted *= TEMPO_STICKINESS;
+      }
+      if (Weighted > Best)
+      {
+         Best = Weighted;
+         BestLag = Lag;
+      }
+   }
+   Tracker.AcfEnergy = Tracker.AcfDecay * Tracker.AcfEnergy + Novelty * Novelty;
+
+   if (BestLag == 0 || Tracker.AcfEnergy <= 0.0f)
+   {
+      Tracker.Confidence = 0.0f;
+      return;
+   }
+
+   /* Parabolic interpolation between the neighbouring lags */
+   f32 Period = (f32)BestLag;
+   if (BestLag > Tracker.MinLag && BestLag < Tracker.MaxLag)
+   {
+      f32 Left = Tracker.Acf[BestLag - 1];
+      f32 Centre = Tracker.Acf[BestLag];
+      f32 Right = Tracker.Acf[BestLag + 1];
+      f32 Curvature = Left - 2.0f * Centre + Right;
+      if (Curvature < 0.0f)
+      {
+         Period += Clamp(-0.5f, 0.5f * (Left - Right) / Curvature, 0.5f);
+      }
+   }
+
+   f32 Ratio = Period / Tracker.Period;
+   if (Ratio < 0.8f || Ratio > 1.25f)
+   {
+      Tracker.Period = Period;
+   }
+   else
+   {
+      Tracker.Period += 0.1f * (Period - Tracker.Period);
+   }
+
+   Tracker.Confidence = Clamp(0.0f, Tracker.Acf[BestLag] / Tracker.AcfEnergy, 1.0f);
+}
+
+/* Pulls the beat phase towards an onset peak seen one tick ago and remembers
+ * which beat of the bar it landed on */
+internal void CorrectPhase(f32 Strength)
+{
+   f32 PeakPhase = Tracker.Phase - 1.0f / Tracker.Period;
+   u32 Slot = Tracker.BeatCount;
+
+   if (PeakPhase < 0.0f)
+   {
+      PeakPhase += 1.0f;
+      Slot -= 1;
+   }
+   if (PeakPhase >= 0.5f)
+   {
+      PeakPhase -= 1.0f;
+      Slot += 1;
+   }
+
+   f32 Correction = Clamp(-PLL_MAX_CORRECTION, PLL_GAIN * PeakPhase, PLL_MAX_CORRECTION);
+   Tracker.Phase = Clamp(0.0f, Tracker.Phase - Correction, 1.0f);
+   Tracker.BarAccent[Slot % BEATS_PER_BAR] += Strength;
+}
+
+internal void Tick(f32 Onset)
+{
+   Tracker.OnsetMean += Tracker.MeanAlpha * (Onset - Tracker.OnsetMean);
+   f32 Novelty = Onset > Tracker.OnsetMean ? Onset - Tracker.OnsetMean : 0.0f;
+   Tracker.NoveltyMean += Tracker.MeanAlpha * (Novelty - Tracker.NoveltyMean);
+   Tracker.PeakLevel = Maximum(Tracker.PeakLevel * Tracker.PeakDecay, Novelty);
+
+   Tracker.Head = (Tracker.Head + 1) & ONSET_HISTORY_MASK;
+   Tracker.Novelty[Tracker.Head] = Novelty;
+
+   UpdateTempo(Novelty);
+
+   f32 Previous = NoveltyAgo(1);
+   if (Previous > Novelty && Previous >= NoveltyAgo(2) &&
+       Previous > PEAK_RATIO * Tracker.NoveltyMean &&
+       Previous > PEAK_SHARE * Tracker.PeakLevel)
+   {
+      CorrectPhase(Previous);
+   }
+}
+
+void BeatUpdate(const f32 *Bands, fl_beat *Beat)
+{
+   u32 Start = k_cycle_get_32();
+
+   Beat->Onset = SpectralFlux(Bands);
+   Tracker.FluxSum += Beat->Onset;
+   if (++Tracker.FluxCount >= Tracker.Decimation)
+   {
+      Tick(Tracker.FluxSum);
+      Tracker.FluxSum = 0.0f;
+      Tracker.FluxCount = 0;
+   }
+
+   Beat->Beat = false;
+   Beat->Downbeat = false;
+   Tracker.Phase += 1.0f / (Tracker.Period * (f32)Tracker.Decimation);
+   if (Tracker.Phase >= 1.0f)
+   {
+      Tracker.Phase -= 1.0f;
+      Tracker.BeatCount++;
+      Beat->Beat = true;
+
+      /* The downbeat is the beat of the bar with the strongest onsets, decaying
+       * once a bar keeps every beat on equal footing while letting it move */
+      if ((Tracker.BeatCount % BEATS_PER_BAR) == 0)
+      {
+         u32 Strongest = 0;
+         for (u32 I = 0; I < BEATS_PER_BAR; ++I)
+         {
+            if (Tracker.BarAccent[I] > Tracker.BarAccent[Strongest])
+            {
+               Strongest = I;
+            }
+         }
+         for (u32 I = 0; I < BEATS_PER_BAR; ++I)
+         {
+            Tracker.BarAccent[I] *= BAR_ACCENT_DECAY;
+         }
+         Tracker.DownbeatSlot = Strongest;
+      }
+      Beat->Downbeat = (Tracker.BeatCount % BEATS_PER_BAR) == Tracker.DownbeatSlot;
+   }
+
+   Beat->Bpm = 60.0f * Tracker.OnsetRate / Tracker.Period;
+   Beat->Phase = Tracker.Phase;
+   Beat->Confidence = Tracker.Confidence;
+   Beat->BeatInBar = (Tracker.BeatCount - Tracker.DownbeatSlot) % BEATS_PER_BAR;
+
+   u32 Cycles = k_cycle_get_32() - Start;
+   Tracker.Stats.Updates++;
+   Tracker.Stats.LastCycles = Cycles;
+   Tracker.Stats.MaxCycles = Maximum(Tracker.Stats.MaxCycles, Cycles);
+}
+
+void BeatGetStats(fl_beat_stats *Stats)
+{
+   *Stats = Tracker.Stats;
+}
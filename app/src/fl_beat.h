@@ -0,0 +1,36 @@
+#ifndef FL_BEAT_H__
+#define FL_BEAT_H__
+
+#include "fl_common.h"
+#include <stdbool.h>
+
+/* Tempo and beat position, refreshed with every analysed frame */
+typedef struct fl_beat {
+   f32 Bpm;
+   /* Position within the current beat, 0 on the beat and approaching 1 just before the next */
+   f32 Phase;
+   /* How periodic the onsets have been lately, 0 to 1 */
+   f32 Confidence;
+   /* Spectral flux of this frame alone, the tempo works on sums of a few */
+   f32 Onset;
+   /* 0 to 3, 0 being the downbeat */
+   u32 BeatInBar;
+   bool Beat;
+   bool Downbeat;
+} fl_beat;
+
+typedef struct {
+   u32 Updates;
+   u32 LastCycles;
+   u32 MaxCycles;
+} fl_beat_stats;
+
+/* -EINVAL for more than 64 bands or no frame rate */
+int BeatInit(f32 FrameRate, u32 NumBands);
+
+/* Band energies in, beat state out, constant work per call */
+void BeatUpdate(const f32 *Bands, fl_beat *Beat);
+
+void BeatGetStats(fl_beat_stats *Stats);
+
+#endif // FL_BEAT_H__
@@ -24,7 +24,13 @@ internal struct k_timer DebounceTimer;
 
 internal void PressReleaseHandler(struct k_timer *dummy)
 {
-   EventEmit(ButtonIsPressed() ? EV_BUTTON_PRESSED : EV_BUTTON_RELEASED);
+   bool Pressed = ButtonIsPressed();
+   fl_event_message Message = {
+      .Type = Pressed ? EV_BUTTON_PRESSED : EV_BUTTON_RELEASED,
+      .Button.Pressed = Pressed,
+   };
+
+   EventEmit(&Message);
 }
 
 internal void ButtonChangeHandler(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
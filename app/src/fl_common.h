@@ -7,8 +7,11 @@
 typedef unsigned char      u8;
 typedef unsigned short     u16;
 typedef unsigned int       u32;
+typedef unsigned long long u64;
 typedef          char      i8;
+typedef          short     i16;
 typedef          int       i32;
+typedef          long long i64;
 typedef          float32_t f32;
 
 #define ArrayCount(Array) (sizeof(Array)/sizeof(Array[0]))
@@ -46,12 +49,93 @@ internal inline f32 Sine(f32 V) {
    return arm_sin_f32(V);
 }
 
-internal inline f32 Random()
+/* Saturating arithmetic on the four u8 lanes of a packed pixel */
+#if defined(ARM_MATH_DSP)
+internal inline u32 PackedAddSaturate(u32 A, u32 B) {
+   return __UQADD8(A, B);
+}
+
+internal inline u32 PackedSubSaturate(u32 A, u32 B) {
+   return __UQSUB8(A, B);
+}
+
+internal inline u32 PackedSum(u32 A) {
+   return __USAD8(A, 0);
+}
+#else
+internal inline u32 PackedAddSaturate(u32 A, u32 B) {
+   u32 Result = 0;
+   for (u32 Shift = 0; Shift < 32; Shift += 8)
+   {
+      Result |= Minimum(((A >> Shift) & 0xFF) + ((B >> Shift) & 0xFF), 0xFF) << Shift;
+   }
+   return Result;
+}
+
+internal inline u32 PackedSubSaturate(u32 A, u32 B) {
+   u32 Result = 0;
+   for (u32 Shift = 0; Shift < 32; Shift += 8)
+   {
+      u32 LaneA = (A >> Shift) & 0xFF;
+      u32 LaneB = (B >> Shift) & 0xFF;
+      Result |= (LaneA > LaneB ? LaneA - LaneB : 0) << Shift;
+   }
+   return Result;
+}
+
+internal inline u32 PackedSum(u32 A) {
+   return (A & 0xFF) + ((A >> 8) & 0xFF) + ((A >> 16) & 0xFF) + (A >> 24);
+}
+#endif
+
+internal inline u32 PackedMinimum(u32 A, u32 B) {
+   return A - PackedSubSaturate(A, B);
+}
+
+internal inline u32 PackedMaximum(u32 A, u32 B) {
+   return B + PackedSubSaturate(A, B);
+}
+
+/* Every lane times Alpha / 256, Alpha from 0 to 256. Two lanes go through
+ * each multiply */
+internal inline u32 PackedScale(u32 A, u32 Alpha) {
+   u32 Even = ((A & 0x00FF00FF) * Alpha >> 8) & 0x00FF00FF;
+   u32 Odd = (((A >> 8) & 0x00FF00FF) * Alpha) & 0xFF00FF00;
+   return Even | Odd;
+}
+
+/* Lanes 0 and 2 of PackedMultiply in one 32x32 to 64 bit multiply. The two
+ * lanes sit 20 bits apart, so the cross products land between them */
+internal inline u32 PackedMultiplyEven(u32 A, u32 B) {
+   u32 Lanes = (A & 0xFF) | ((A & 0x00FF0000) << 4);
+   u32 Factors = ((B & 0xFF) + 1) | ((((B >> 16) & 0xFF) + 1) << 20);
+   u64 Product = (u64)Lanes * Factors;
+   return ((u32)(Product >> 8) & 0xFF) | (((u32)(Product >> 48) & 0xFF) << 16);
+}
+
+/* A * B / 255 per lane, exact where either is 0 or 255 */
+internal inline u32 PackedMultiply(u32 A, u32 B) {
+   return PackedMultiplyEven(A, B) | (PackedMultiplyEven(A >> 8, B >> 8) << 8);
+}
+
+/* xorshift32, the same seed gives the same sequence on every target.
+ * State must not be 0 */
+internal inline u32 RandomNext(u32 *State)
 {
-   const f32 OneOverMaxU32 = 1.0f / (f32)(0xffffffff);
-   f32 Value = (f32)sys_rand32_get();
+   u32 X = *State;
+
+   X ^= X << 13;
+   X ^= X >> 17;
+   X ^= X << 5;
+   *State = X;
 
-   return Value * OneOverMaxU32;
+   return X;
+}
+
+/* Uniform in [0, 1) */
+internal inline f32 RandomUnit(u32 *State)
+{
+   return (f32)(RandomNext(State) >> 8) * (1.0f / 16777216.0f);
 }
 
 #endif
@@ -0,0 +1,156 @@
+#include <stdbool.h>
+#include <string.h>
+#include "fl_common.h"
+#include "fl_compose.h"
+
+/* Channel sum under which BLEND_FILL counts a pixel as dark */
+#define FILL_MAX_SUM (50)
+
+typedef void (*blend_kernel)(pixel *Below, const pixel *Layer, u32 Count, u32 Alpha);
+
+internal const char *ModeNames[BLEND_MAX_IDX] = {
+   [BLEND_ADD] = "add",
+   [BLEND_MAX] = "max",
+   [BLEND_ALPHA] = "alpha",
+   [BLEND_MULTIPLY] = "multiply",
+   [BLEND_FILL] = "fill",
+};
+
+internal void BlendAdd(pixel *Below, const pixel *Layer, u32 Count, u32 Alpha)
+{
+   for (u32 I = 0; I < Count; ++I)
+   {
+      Below[I].Dword = PackedAddSaturate(Below[I].Dword, PackedScale(Layer[I].Dword, Alpha));
+   }
+}
+
+internal void BlendMax(pixel *Below, const pixel *Layer, u32 Count, u32 Alpha)
+{
+   for (u32 I = 0; I < Count; ++I)
+   {
+      Below[I].Dword = PackedMaximum(Below[I].Dword, PackedScale(Layer[I].Dword, Alpha));
+   }
+}
+
+/* The two scaled lanes never add up to more than 255 */
+internal void BlendAlpha(pixel *Below, const pixel *Layer, u32 Count, u32 Alpha)
+{
+   for (u32 I = 0; I < Count; ++I)
+   {
+      Below[I].Dword = PackedScale(Layer[I].Dword, Alpha) +
+                       PackedScale(Below[I].Dword, 256 - Alpha);
+   }
+}
+
+internal void BlendMultiply(pixel *Below, const pixel *Layer, u32 Count, u32 Alpha)
+{
+   for (u32 I = 0; I < Count; ++I)
+   {
+      u32 Product = PackedMultiply(Below[I].Dword, Layer[I].Dword);
+      Below[I].Dword = PackedScale(Product, Alpha) + PackedScale(Below[I].Dword, 256 - Alpha);
+   }
+}
+
+internal void BlendFill(pixel *Below, const pixel *Layer, u32 Count, u32 Alpha)
+{
+   for (u32 I = 0; I < Count; ++I)
+   {
+      if (PackedSum(Below[I].Dword) < FILL_MAX_SUM)
+      {
+         Below[I].Dword = PackedAddSaturate(Below[I].Dword, PackedScale(Layer[I].Dword, Alpha));
+      }
+   }
+}
+
+internal const blend_kernel Kernels[BLEND_MAX_IDX] = {
+   [BLEND_ADD] = BlendAdd,
+   [BLEND_MAX] = BlendMax,
+   [BLEND_ALPHA] = BlendAlpha,
+   [BLEND_MULTIPLY] = BlendMultiply,
+   [BLEND_FILL] = BlendFill,
+};
+
+internal inline void DrawLayer(const fl_layer *Layer, pixel *Tile, u32 First, u32 Count)
+{
+   if (Layer->Render)
+   {
+      Layer->Render(Tile, First, Count);
+      return;
+   }
+   for (u32 I = 0; I < Count; ++I)
+   {
+      Tile[I].Dword = Layer->Color;
+   }
+}
+
+/* Any mode but multiply puts a layer that fully shows over black as it is,
+ * so the first one that is drawn goes straight into the tile */
+void ComposeRender(fl_layer *Layers, u32 NumLayers, f32 Blend, u32 Limit,
+                   pixel *Pixels, u32 NumPixels)
+{
+   pixel Tile[COMPOSE_TILE_PIXELS];
+   pixel LayerTile[COMPOSE_TILE_PIXELS];
+
+   for (u32 L = 0; L < NumLayers; ++L)
+   {
+      fl_layer *Layer = &Layers[L];
+      u32 Shows = Minimum(Layer->Prepare ? Layer->Prepare(Layer, Blend) : 256, 256);
+      u32 Opacity = Minimum(Layer->Opacity, 255);
+
+      Layer->Alpha = (Shows * (Opacity + (Opacity >> 7))) >> 8;
+   }
+
+   for (u32 First = 0; First < NumPixels; First += COMPOSE_TILE_PIXELS)
+   {
+      u32 Count = Minimum(COMPOSE_TILE_PIXELS, NumPixels - First);
+      bool Black = true;
+
+      memset(Tile, 0, Count * sizeof(pixel));
+      for (u32 L = 0; L < NumLayers; ++L)
+      {
+         const fl_layer *Layer = &Layers[L];
+
+         if (Layer->Alpha == 0)
+         {
+            continue;
+         }
+         if (Black && Layer->Alpha == 256 && Layer->Mode != BLEND_MULTIPLY)
+         {
+            DrawLayer(Layer, Tile, First, Count);
+         }
+         else
+         {
+            if (Layer->Render)
+            {
+               memset(LayerTile, 0, Count * sizeof(pixel));
+            }
+            DrawLayer(Layer, LayerTile, First, Count);
+            Kernels[Layer->Mode](Tile, LayerTile, Count, Layer->Alpha);
+         }
+         Black = false;
+      }
+
+      for (u32 I = 0; I < Count; ++I)
+      {
+         Pixels[First + I].Dword = PackedMinimum(Tile[I].Dword, Limit);
+      }
+   }
+}
+
+const char *ComposeModeName(fl_blend_mode Mode)
+{
+   return Mode < BLEND_MAX_IDX ? ModeNames[Mode] : "?";
+}
+
+fl_blend_mode ComposeModeFromName(const char *Name)
+{
+   for (fl_blend_mode Mode = 0; Mode < BLEND_MAX_IDX; ++Mode)
+   {
+      if (strcmp(Name, ModeNames[Mode]) == 0)
+      {
+         return Mode;
+      }
+   }
+
+   return BLEND_MAX_IDX;
+}
@@ -0,0 +1,56 @@
+#ifndef FL_COMPOSE_H__
+#define FL_COMPOSE_H__
+
+#include "fl_common.h"
+#include "fl_strip.h"
+
+/* Layers are drawn this many pixels at a time, a Render callback never
+ * gets a stretch that crosses a multiple of it */
+#define COMPOSE_TILE_SHIFT (5)
+#define COMPOSE_TILE_PIXELS (1 << COMPOSE_TILE_SHIFT)
+
+typedef enum {
+   /* Added to what is below, saturating at 255 */
+   BLEND_ADD,
+   /* The brighter of the two, per channel */
+   BLEND_MAX,
+   /* Drawn over what is below */
+   BLEND_ALPHA,
+   /* Darkens what is below */
+   BLEND_MULTIPLY,
+   /* Added only where what is below is dark */
+   BLEND_FILL,
+   BLEND_MAX_IDX,
+} fl_blend_mode;
+
+typedef struct fl_layer fl_layer;
+
+struct fl_layer {
+   const char *Name;
+   fl_blend_mode Mode;
+   /* 0 to 255 */
+   u32 Opacity;
+   /* Called once per frame before any pixel is drawn, Blend as in
+    * LightsRender. Returns how much of the layer shows this frame, 0 to
+    * 256, a layer that does not show is skipped */
+   u32 (*Prepare)(fl_layer *Layer, f32 Blend);
+   /* Draws the Count pixels from First into Tile, which starts out black.
+    * Without one the layer is Color all over */
+   void (*Render)(pixel *Tile, u32 First, u32 Count);
+   /* Packed pixel, set by Prepare when there is no Render */
+   u32 Color;
+   /* Opacity times what Prepare returned, 0 to 256, for the last frame */
+   u32 Alpha;
+};
+
+/* Draws the layers from the bottom up and limits every channel of the
+ * result to the one in Limit, a packed pixel */
+void ComposeRender(fl_layer *Layers, u32 NumLayers, f32 Blend, u32 Limit,
+                   pixel *Pixels, u32 NumPixels);
+
+const char *ComposeModeName(fl_blend_mode Mode);
+
+/* BLEND_MAX_IDX if there is no mode of that name */
+fl_blend_mode ComposeModeFromName(const char *Name);
+
+#endif /* FL_COMPOSE_H__ */
@@ -1,89 +1,519 @@
 #include "fl_common.h"
 #include "fl_dsp.h"
 #include "arm_math.h"
+#include <errno.h>
+#include <string.h>
 
 #define LOG_LEVEL 4
 #include <logging/log.h>
 LOG_MODULE_REGISTER(dsp);
 
+u32 DspStftInit(fl_stft *Stft, u16 *History, u32 WindowSize)
+{
+   Stft->History = History;
+   Stft->WindowSize = WindowSize;
+   Stft->WritePos = 0;
+   Stft->Filled = 0;
+
+   return 0;
+}
 
-u32 DspCalculateSpectrum(f32 *Input, u32 NumSamples, f32 *IntermediateBuffer, f32 *Output)
+u16* DspStftPush(fl_stft *Stft, u16 *Samples, u32 NumSamples)
 {
-   f32 FfftScalingFactor = 1.0f / (f32)NumSamples;
-   arm_rfft_fast_instance_f32 fft;
+   u32 WindowSize = Stft->WindowSize;
 
-   arm_rfft_fast_init_f32(&fft, NumSamples);
-   arm_rfft_fast_f32(&fft, Input, IntermediateBuffer, 0);
-   arm_cmplx_mag_f32(IntermediateBuffer, Output, NumSamples/2);
+   Stft->Filled = Minimum(Stft->Filled + NumSamples, WindowSize);
 
-   static f32 MaxSpectrum = -32000.0f;
-   static f32 MinSpectrum = 32000.0f;
-   for (int i = 1; i < NumSamples/2; ++i)
+   while (NumSamples > 0)
    {
-      Output[i] *= FfftScalingFactor;
-      if (Output[i] > MaxSpectrum) MaxSpectrum = Output[i];
-      if (Output[i] < MinSpectrum) MinSpectrum = Output[i];
+      u32 Chunk = Minimum(NumSamples, WindowSize - Stft->WritePos);
+
+      memcpy(&Stft->History[Stft->WritePos], Samples, Chunk * sizeof(u16));
+      memcpy(&Stft->History[Stft->WritePos + WindowSize], Samples, Chunk * sizeof(u16));
+
+      Stft->WritePos += Chunk;
+      if (Stft->WritePos == WindowSize)
+      {
+         Stft->WritePos = 0;
+      }
+      Samples += Chunk;
+      NumSamples -= Chunk;
    }
-#if 0
-   static u32 DebugCount = 0;
-   if (DebugCount++ > 100)
+
+   return DspStftWindow(Stft);
+}
+
+void DspStftReset(fl_stft *Stft)
+{
+   Stft->WritePos = 0;
+   Stft->Filled = 0;
+}
+
+u16* DspStftWindow(fl_stft *Stft)
+{
+   /* The oldest sample sits at the write position */
+   return (Stft->Filled == Stft->WindowSize) ? &Stft->History[Stft->WritePos] : NULL;
+}
+
+internal f32 WindowValue(fl_dsp_window WindowType, u32 I, u32 FftSize)
+{
+   /* Periodic windows, consecutive hops overlap-add to a constant */
+   f32 Phase = 2.0f * PI * (f32)I / (f32)FftSize;
+
+   switch (WindowType)
    {
-      LOG_INF("MinS: %d, MaxS: %d:", (i32)(MinSpectrum * 1000.0f), (i32)(MaxSpectrum * 1000.0f));
-      DebugCount = 0;
+      case DSP_WINDOW_HANN:
+         return 0.5f - 0.5f * cosf(Phase);
+      case DSP_WINDOW_BLACKMAN:
+         return 0.42f - 0.5f * cosf(Phase) + 0.08f * cosf(2.0f * Phase);
+      case DSP_WINDOW_RECTANGULAR:
+      default:
+         return 1.0f;
    }
-#endif
-   
-
-   /* TODO(kleindan) Check for error from CMSIS */
-   return 0;
 }
 
-u32 DspNormalizeSamples(u16 *RawSamples, u32 NumSamples, f32 *Output)
+internal void SampleStats(u16 *RawSamples, u32 NumSamples, u32 *Sum, u16 *Min, u16 *Max)
 {
+   u32 SamplesSum = 0;
+   u32 I = 0;
+
+#if defined(ARM_MATH_DSP)
+   /* Two samples per load; the 12-bit samples never set the q15 sign bit */
+   q15_t *Samples = (q15_t *)RawSamples;
+   u32 MinPair = 0xFFFFFFFF;
+   u32 MaxPair = 0x00000000;
+
+   for ( ; I + 2 <= NumSamples; I += 2)
+   {
+      u32 Pair = (u32)read_q15x2_ia(&Samples);
+
+      SamplesSum = __SMLAD(Pair, 0x00010001, SamplesSum);
+      /* The saturating difference is 0 in the lanes that don't move, no
+       * lane can borrow or carry into the other */
+      MinPair -= __UQSUB16(MinPair, Pair);
+      MaxPair += __UQSUB16(Pair, MaxPair);
+   }
+
+   u16 MinSample = Minimum(MinPair & 0xFFFF, MinPair >> 16);
+   u16 MaxSample = Maximum(MaxPair & 0xFFFF, MaxPair >> 16);
+#else
    u16 MinSample = 0xffff;
    u16 MaxSample = 0x0000;
-   u32 SamplesSum = 0;
-   f32 MinSampleF = 0.0f;
-   f32 MaxSampleF = 0.0f;
-   f32 Mean = 0;
+#endif
+
+   for ( ; I < NumSamples; ++I)
+   {
+      SamplesSum += RawSamples[I];
+      if (RawSamples[I] < MinSample) MinSample = RawSamples[I];
+      if (RawSamples[I] > MaxSample) MaxSample = RawSamples[I];
+   }
+
+   *Sum = SamplesSum;
+   *Min = MinSample;
+   *Max = MaxSample;
+}
 
-   for (int i = 0; i < NumSamples; ++i)
+/* Returns the deviation from the mean the samples get normalized by */
+internal f32 SampleRange(u16 *RawSamples, u32 NumSamples, f32 *Mean)
+{
+   u32 SamplesSum;
+   u16 MinSample;
+   u16 MaxSample;
+
+   SampleStats(RawSamples, NumSamples, &SamplesSum, &MinSample, &MaxSample);
+   *Mean = ((f32) SamplesSum) / ((f32) NumSamples);
+
+   u16 RangeLo = (u16)*Mean - MinSample;
+   u16 RangeHi = MaxSample - (u16)*Mean;
+   u16 Range = Maximum(RangeLo, RangeHi);
+
+   return Clamp(800.0f, (f32)Range, 2048);
+}
+
+#if !defined(CONFIG_FEELIGHTS_DSP_Q15) || defined(CONFIG_FEELIGHTS_DSP_ACCURACY_CHECK)
+internal int DspInitF32(fl_dsp_f32 *Dsp, u32 FftSize, fl_dsp_window WindowType, void *Buffer)
+{
+   f32 WindowSum = 0.0f;
+
+   /* DspNormalizeSamplesF32 works four samples at a time */
+   if ((FftSize % 4) != 0 || arm_rfft_fast_init_f32(&Dsp->Fft, FftSize) != ARM_MATH_SUCCESS)
    {
-      SamplesSum += RawSamples[i];
-      if (RawSamples[i] < MinSample) MinSample = RawSamples[i];
-      if (RawSamples[i] > MaxSample) MaxSample = RawSamples[i];
+      LOG_ERR("Unsupported FFT size %u", FftSize);
+      return -EINVAL;
    }
-   Mean = ((f32) SamplesSum) / ((f32) NumSamples);
 
-#if 0
-   static u32 DebugCount = 0;
-   if (DebugCount++ > 100)
+   Dsp->FftSize = FftSize;
+   Dsp->Window = (f32 *)Buffer;
+   Dsp->Input = Dsp->Window + FftSize;
+   Dsp->Complex = Dsp->Input + FftSize;
+   Dsp->Spectrum = Dsp->Complex + FftSize;
+
+   for (u32 I = 0; I < FftSize; ++I)
    {
-      LOG_INF("Min: %d, Max: %d:, Mean %d", MinSample, MaxSample, (u32)(Mean * 1000.f));
-      DebugCount = 0;
+      Dsp->Window[I] = WindowValue(WindowType, I, FftSize);
+      WindowSum += Dsp->Window[I];
    }
+
+   /* Compensate the coherent gain, so the spectrum magnitudes don't depend on
+    * the window choice. The 1/N FFT scaling is folded in here as well. */
+   arm_scale_f32(Dsp->Window, 1.0f / WindowSum, Dsp->Window, FftSize);
+
+   return 0;
+}
+
+internal u32 DspNormalizeSamplesF32(fl_dsp_f32 *Dsp, u16 *RawSamples)
+{
+   u32 NumSamples = Dsp->FftSize;
+   f32 Mean;
+   f32 NormalizationFactor = 1.0f / SampleRange(RawSamples, NumSamples, &Mean);
+
+   /* Remove DC, normalize and apply the window in a single pass. The CMSIS
+    * f32 basic math is plain scalar code on the M4 as well, chained it would
+    * take four passes over the samples */
+   f32 *Window = Dsp->Window;
+   f32 *Output = Dsp->Input;
+   for (u32 I = 0; I < NumSamples; I += 4)
+   {
+      Output[I + 0] = (((f32) RawSamples[I + 0]) - Mean) * (NormalizationFactor * Window[I + 0]);
+      Output[I + 1] = (((f32) RawSamples[I + 1]) - Mean) * (NormalizationFactor * Window[I + 1]);
+      Output[I + 2] = (((f32) RawSamples[I + 2]) - Mean) * (NormalizationFactor * Window[I + 2]);
+      Output[I + 3] = (((f32) RawSamples[I + 3]) - Mean) * (NormalizationFactor * Window[I + 3]);
+   }
+
+   return 0;
+}
+
+internal u32 DspCalculateSpectrumF32(fl_dsp_f32 *Dsp)
+{
+   arm_rfft_fast_f32(&Dsp->Fft, Dsp->Input, Dsp->Complex, 0);
+   arm_cmplx_mag_f32(Dsp->Complex, Dsp->Spectrum, Dsp->FftSize/2);
+
+   return 0;
+}
 #endif
 
-   u16 RangeLo = (u16)Mean - MinSample;
-   u16 RangeHi = MaxSample - (u16)Mean;
-   u16 Range = Maximum(RangeLo, RangeHi);
-   f32 NormalizationFactor = 1.0/Clamp(800.0f, (f32)Range, 2048);
-   for (int i = 0; i < NumSamples; ++i)
+#if defined(CONFIG_FEELIGHTS_DSP_Q15)
+internal int DspInitQ15(fl_dsp_q15 *Dsp, u32 FftSize, fl_dsp_window WindowType, void *Buffer)
+{
+   f32 WindowSum = 0.0f;
+
+   if (arm_rfft_init_q15(&Dsp->Fft, FftSize, 0, 1) != ARM_MATH_SUCCESS)
+   {
+      LOG_ERR("Unsupported FFT size %u", FftSize);
+      return -EINVAL;
+   }
+
+   Dsp->FftSize = FftSize;
+   Dsp->WindowType = WindowType;
+   Dsp->Window = (q15_t *)Buffer;
+   Dsp->Input = Dsp->Window + FftSize;
+   Dsp->Complex = Dsp->Input + FftSize;
+   Dsp->Spectrum = Dsp->Complex + 2 * FftSize;
+
+   for (u32 I = 0; I < FftSize; ++I)
+   {
+      f32 Value = WindowValue(WindowType, I, FftSize);
+      Dsp->Window[I] = (q15_t)(Value * 32767.0f);
+      WindowSum += Value;
+   }
+
+   /* The q15 FFT downscales internally by a size dependent factor,
+    * measure it once with a DC input instead of tabulating it */
+   for (u32 I = 0; I < FftSize; ++I)
+   {
+      Dsp->Input[I] = 0x2000;
+   }
+   arm_rfft_q15(&Dsp->Fft, Dsp->Input, Dsp->Complex);
+   if (Dsp->Complex[0] <= 0)
    {
-      Output[i] = NormalizationFactor * (((f32) RawSamples[i]) - Mean);
-      if (Output[i] < MinSampleF) MinSampleF = Output[i];
-      if (Output[i] > MaxSampleF) MaxSampleF = Output[i];
+      LOG_ERR("Unexpected q15 FFT output %d", Dsp->Complex[0]);
+      return -EIO;
    }
-#if 0
-   static u32 DebugCount = 0;
-   if (DebugCount++ > 100)
+   f32 Downscale = exp2f(roundf(log2f((f32)(0x2000 * FftSize) / (f32)Dsp->Complex[0])));
+
+   /* Magnitudes come out in 2.14 scaled down by the FFT, bring them back and
+    * compensate the window coherent gain like the float engine does */
+   f32 Gain = Downscale / WindowSum;
+   Dsp->GainShift = 0;
+   while (Gain >= 1.0f)
+   {
+      Gain *= 0.5f;
+      Dsp->GainShift++;
+   }
+   Dsp->GainFract = (q15_t)Minimum(Gain * 32768.0f, 32767.0f);
+
+   return 0;
+}
+
+internal u32 DspNormalizeSamplesQ15(fl_dsp_q15 *Dsp, u16 *RawSamples)
+{
+   u32 NumSamples = Dsp->FftSize;
+   f32 MeanF;
+   f32 Range = SampleRange(RawSamples, NumSamples, &MeanF);
+   i32 Mean = (i32)(MeanF + 0.5f);
+   i32 NormalizationFactor = (i32)(32767.0f * 4096.0f / Range);
+
+   /* Remove DC, normalize to the full q15 range and apply the window */
+   q15_t *Window = Dsp->Window;
+   q15_t *Output = Dsp->Input;
+   for (u32 I = 0; I < NumSamples; ++I)
    {
-      LOG_INF("Minf: %d, Maxf: %d:", (i32)(MinSampleF * 1000.0f), (i32)(MaxSampleF * 1000.0f));
-      DebugCount = 0;
+      q15_t Sample = clip_q31_to_q15((((i32)RawSamples[I] - Mean) * NormalizationFactor) >> 12);
+      Output[I] = (q15_t)(((q31_t)Sample * Window[I]) >> 15);
    }
+
+   return 0;
+}
+
+internal u32 DspCalculateSpectrumQ15(fl_dsp_q15 *Dsp)
+{
+   arm_rfft_q15(&Dsp->Fft, Dsp->Input, Dsp->Complex);
+   arm_cmplx_mag_q15(Dsp->Complex, Dsp->Spectrum, Dsp->FftSize/2);
+   arm_scale_q15(Dsp->Spectrum, Dsp->GainFract, Dsp->GainShift, Dsp->Spectrum, Dsp->FftSize/2);
+
+   return 0;
+}
+
+int DspInit(fl_dsp *Dsp, u32 FftSize, fl_dsp_window WindowType, void *Buffer)
+{
+   return DspInitQ15(Dsp, FftSize, WindowType, Buffer);
+}
+
+u32 DspNormalizeSamples(fl_dsp *Dsp, u16 *RawSamples)
+{
+   return DspNormalizeSamplesQ15(Dsp, RawSamples);
+}
+
+u32 DspCalculateSpectrum(fl_dsp *Dsp)
+{
+   return DspCalculateSpectrumQ15(Dsp);
+}
+#else
+int DspInit(fl_dsp *Dsp, u32 FftSize, fl_dsp_window WindowType, void *Buffer)
+{
+   return DspInitF32(Dsp, FftSize, WindowType, Buffer);
+}
+
+u32 DspNormalizeSamples(fl_dsp *Dsp, u16 *RawSamples)
+{
+   return DspNormalizeSamplesF32(Dsp, RawSamples);
+}
+
+u32 DspCalculateSpectrum(fl_dsp *Dsp)
+{
+   return DspCalculateSpectrumF32(Dsp);
+}
 #endif
 
-   /* TODO(kleindan) Check for error from CMSIS */
+void DspSampleLevels(const u16 *Samples, u32 NumSamples, u16 *Rms, u16 *Peak)
+{
+   u32 Sum = 0;
+   u64 SumSq = 0;
+   u16 Min = 0xFFFF;
+   u16 Max = 0;
+
+   for (u32 I = 0; I < NumSamples; ++I)
+   {
+      u32 Sample = Samples[I];
+      Sum += Sample;
+      SumSq += Sample * Sample;
+      Min = Minimum(Min, Sample);
+      Max = Maximum(Max, Sample);
+   }
+
+   /* N^2 times the variance, exact in integers; in f32 both terms are
+    * around 4e6 and round by as much as a quiet room's variance */
+   u64 ScaledVariance = (u64)NumSamples * SumSq - (u64)Sum * Sum;
+   f32 Mean = (f32)Sum / (f32)NumSamples;
+   f32 Variance = (f32)ScaledVariance / ((f32)NumSamples * (f32)NumSamples);
+
+   *Rms = (u16)sqrtf(Variance);
+   *Peak = (u16)Maximum(Mean - (f32)Min, (f32)Max - Mean);
+}
+
+internal inline f32 FrequencyToMel(f32 Frequency)
+{
+   return 2595.0f * log10f(1.0f + Frequency / 700.0f);
+}
+
+internal inline f32 MelToFrequency(f32 Mel)
+{
+   return 700.0f * (powf(10.0f, Mel / 2595.0f) - 1.0f);
+}
+
+u32 DspBandsInit(fl_dsp *Dsp, u32 NumBands, f32 SampleRate, f32 MinFrequency, f32 MaxFrequency,
+                 fl_band *Bands, f32 *Weights)
+{
+   fl_filterbank *Bank = &Dsp->Bank;
+   u32 NumBins = Dsp->FftSize / 2;
+   f32 BinsPerHz = (f32)Dsp->FftSize / SampleRate;
+   f32 MinMel = FrequencyToMel(MinFrequency);
+   f32 MelStep = (FrequencyToMel(Minimum(MaxFrequency, SampleRate / 2.0f)) - MinMel) / (f32)(NumBands + 1);
+   u32 NumWeights = 0;
+
+   Bank->Bands = Bands;
+   Bank->Weights = Weights;
+   Bank->NumBands = NumBands;
+
+   for (u32 IBand = 0; IBand < NumBands; ++IBand)
+   {
+      /* Band edges as fractional bins, the triangle peaks at the center */
+      f32 Lo = MelToFrequency(MinMel + MelStep * (f32)(IBand + 0)) * BinsPerHz;
+      f32 Center = MelToFrequency(MinMel + MelStep * (f32)(IBand + 1)) * BinsPerHz;
+      f32 Hi = MelToFrequency(MinMel + MelStep * (f32)(IBand + 2)) * BinsPerHz;
+      u32 FirstBin = (u32)ceil(Lo);
+      u32 LastBin = Minimum((u32)floor(Hi), NumBins - 1);
+      fl_band *Band = &Bands[IBand];
+      f32 WeightSum = 0.0f;
+
+      Band->FirstWeight = NumWeights;
+      Band->FirstBin = FirstBin;
+      Band->NumBins = 0;
+
+      for (u32 Bin = FirstBin; Bin <= LastBin; ++Bin)
+      {
+         f32 Weight = (Bin <= Center) ? ((f32)Bin - Lo) / (Center - Lo)
+                                      : (Hi - (f32)Bin) / (Hi - Center);
+         if (Weight <= 0.0f)
+         {
+            if (Band->NumBins == 0)
+            {
+               Band->FirstBin++;
+               continue;
+            }
+            break;
+         }
+         Weights[NumWeights + Band->NumBins++] = Weight;
+         WeightSum += Weight;
+      }
+
+      /* Bands narrower than a bin take the bin closest to their center */
+      if (Band->NumBins == 0)
+      {
+         Band->FirstBin = Minimum((u32)Round(Center), NumBins - 1);
+         Band->NumBins = 1;
+         Weights[NumWeights] = 1.0f;
+         WeightSum = 1.0f;
+      }
+
+      /* Normalized to a weighted mean, the bin format conversion folded in */
+      for (u32 I = 0; I < Band->NumBins; ++I)
+      {
+         Weights[NumWeights + I] *= DSP_BIN_TO_F32(1) / WeightSum;
+      }
+      NumWeights += Band->NumBins;
+   }
+
+   return 0;
+}
+
+void DspCalculateBands(fl_dsp *Dsp, f32 *Output)
+{
+   fl_filterbank *Bank = &Dsp->Bank;
+
+   for (u32 IBand = 0; IBand < Bank->NumBands; ++IBand)
+   {
+      fl_band *Band = &Bank->Bands[IBand];
+      fl_bin *Bins = &Dsp->Spectrum[Band->FirstBin];
+      f32 *Weights = &Bank->Weights[Band->FirstWeight];
+      f32 Energy = 0.0f;
+
+      for (u32 I = 0; I < Band->NumBins; ++I)
+      {
+         Energy += Weights[I] * (f32)Bins[I];
+      }
+      Output[IBand] = Energy;
+   }
+}
+
+void DspCalculateCumulative(fl_dsp *Dsp, fl_bin_sum *Output)
+{
+   u32 NumBins = Dsp->FftSize / 2;
+   fl_bin *Spectrum = Dsp->Spectrum;
+   fl_bin_sum Sum = 0;
+
+   Output[0] = 0;
+   for (u32 I = 0; I < NumBins; ++I)
+   {
+      if (Spectrum[I] > DSP_BIN_NOISE_FLOOR)
+      {
+         Sum += Spectrum[I];
+      }
+      Output[I + 1] = Sum;
+   }
+}
+
+internal inline f32 CumulativeAt(fl_audio_features *Features, f32 Bin)
+{
+   Bin = Clamp(0.0f, Bin, (f32)Features->NumBins);
+
+   u32 Index = (u32)Bin;
+   f32 Fraction = Bin - (f32)Index;
+   f32 Value = (f32)Features->Cumulative[Index];
+
+   if (Index < Features->NumBins)
+   {
+      Value += Fraction * (f32)(Features->Cumulative[Index + 1] - Features->Cumulative[Index]);
+   }
+
+   return Value;
+}
+
+f32 DspWindowEnergy(fl_audio_features *Features, f32 LoBin, f32 HiBin)
+{
+   LoBin *= Features->BinScale;
+   HiBin *= Features->BinScale;
+
+   return DSP_BIN_TO_F32(CumulativeAt(Features, HiBin) - CumulativeAt(Features, LoBin));
+}
+
+#if defined(CONFIG_FEELIGHTS_DSP_ACCURACY_CHECK)
+#define ACCURACY_CHECK_INTERVAL (32)
+
+internal f32 ReferenceBuffer[DSP_F32_BUFFER_SIZE(CONFIG_FEELIGHTS_FFT_SIZE) / sizeof(f32)];
+internal fl_dsp_f32 Reference;
+internal fl_dsp_accuracy Accuracy;
+
+int DspAccuracyCheck(fl_dsp *Dsp, u16 *RawSamples)
+{
+   static u32 FrameCount = 0;
+
+   if ((FrameCount++ % ACCURACY_CHECK_INTERVAL) != 0)
+   {
+      return 0;
+   }
+
+   if (Reference.FftSize != Dsp->FftSize)
+   {
+      if (Dsp->FftSize > CONFIG_FEELIGHTS_FFT_SIZE)
+      {
+         return -EINVAL;
+      }
+      int Result = DspInitF32(&Reference, Dsp->FftSize, Dsp->WindowType, ReferenceBuffer);
+      if (Result != 0)
+      {
+         return Result;
+      }
+   }
+
+   DspNormalizeSamplesF32(&Reference, RawSamples);
+   DspCalculateSpectrumF32(&Reference);
+
+   for (u32 I = 1; I < Dsp->FftSize / 2; ++I)
+   {
+      f32 Error = DSP_BIN_TO_F32(Dsp->Spectrum[I]) - Reference.Spectrum[I];
+
+      Accuracy.MaxError = Maximum(Accuracy.MaxError, Abs(Error));
+      Accuracy.ErrorEnergy += Square(Error);
+      Accuracy.ReferenceEnergy += Square(Reference.Spectrum[I]);
+   }
+   Accuracy.FramesCompared++;
+
    return 0;
 }
 
+void DspGetAccuracy(fl_dsp_accuracy *Result)
+{
+   *Result = Accuracy;
+}
+#endif
@@ -3,8 +3,157 @@
 
 #include "fl_common.h"
 
-u32 DspCalculateSpectrum(f32 *Input, u32 NumSamples, f32 *IntermediateBuffer, f32 *Output);
+struct fl_beat;
 
-u32 DspNormalizeSamples(u16 *RawSamples, u32 NumSamples, f32 *Output);
+/* Sliding analysis window over the incoming audio, every sample is stored
+ * twice so the last WindowSize samples are always contiguous in memory */
+typedef struct {
+   u16 *History;
+   u32 WindowSize;
+   u32 WritePos;
+   u32 Filled;
+} fl_stft;
+
+/* History has to hold 2 * WindowSize samples */
+u32 DspStftInit(fl_stft *Stft, u16 *History, u32 WindowSize);
+
+/* Appends a hop of samples, returns the current window or NULL until it is full */
+u16* DspStftPush(fl_stft *Stft, u16 *Samples, u32 NumSamples);
+
+/* Drops the history, for when the next samples do not follow the last ones */
+void DspStftReset(fl_stft *Stft);
+
+/* Returns the current window or NULL if it is not full yet */
+u16* DspStftWindow(fl_stft *Stft);
+
+typedef enum {
+   DSP_WINDOW_RECTANGULAR,
+   DSP_WINDOW_HANN,
+   DSP_WINDOW_BLACKMAN,
+} fl_dsp_window;
+
+/* One filterbank band, its weights are stored contiguously from FirstWeight */
+typedef struct {
+   u16 FirstBin;
+   u16 NumBins;
+   u16 FirstWeight;
+} fl_band;
+
+/* Sparse triangular mel filters mapping FFT bins to band energies */
+typedef struct {
+   fl_band *Bands;
+   f32 *Weights;
+   u32 NumBands;
+} fl_filterbank;
+
+/* Upper bound of the weights needed, every bin is shared by at most two bands */
+#define DSP_FILTERBANK_MAX_WEIGHTS(FftSize, NumBands) ((FftSize) + (NumBands))
+
+/* Everything needed to calculate the spectrum for one FFT size,
+ * the FFT plan and the window table are set up once in DspInit */
+typedef struct {
+   arm_rfft_fast_instance_f32 Fft;
+   u32 FftSize;
+   f32 *Window;
+   f32 *Input;
+   f32 *Complex;
+   f32 *Spectrum;
+   fl_filterbank Bank;
+} fl_dsp_f32;
+
+typedef struct {
+   arm_rfft_instance_q15 Fft;
+   u32 FftSize;
+   fl_dsp_window WindowType;
+   q15_t *Window;
+   q15_t *Input;
+   q15_t *Complex;
+   q15_t *Spectrum;
+   /* Brings the magnitudes to the same scale as the float engine */
+   q15_t GainFract;
+   i8 GainShift;
+   fl_filterbank Bank;
+} fl_dsp_q15;
+
+#define DSP_F32_BUFFER_SIZE(FftSize) ((3 * (FftSize) + (FftSize) / 2) * sizeof(f32))
+#define DSP_Q15_BUFFER_SIZE(FftSize) ((4 * (FftSize) + (FftSize) / 2) * sizeof(q15_t))
+
+#if defined(CONFIG_FEELIGHTS_DSP_Q15)
+typedef fl_dsp_q15 fl_dsp;
+/* Spectrum magnitudes in 2.14 format */
+typedef q15_t fl_bin;
+typedef i32 fl_bin_sum;
+#define DSP_BIN_FROM_F32(Value) ((fl_bin)((Value) * 16384.0f))
+#define DSP_BIN_TO_F32(Value) ((f32)(Value) * (1.0f / 16384.0f))
+#define DSP_BUFFER_SIZE(FftSize) DSP_Q15_BUFFER_SIZE(FftSize)
+#else
+typedef fl_dsp_f32 fl_dsp;
+typedef f32 fl_bin;
+typedef f32 fl_bin_sum;
+#define DSP_BIN_FROM_F32(Value) (Value)
+#define DSP_BIN_TO_F32(Value) (Value)
+#define DSP_BUFFER_SIZE(FftSize) DSP_F32_BUFFER_SIZE(FftSize)
+#endif
+
+/* Buffer has to be DSP_BUFFER_SIZE(FftSize) bytes, word aligned. Returns
+ * -EINVAL for sizes the real FFT does not support */
+int DspInit(fl_dsp *Dsp, u32 FftSize, fl_dsp_window WindowType, void *Buffer);
+
+/* Raw ADC samples to windowed FFT input, FftSize samples are read */
+u32 DspNormalizeSamples(fl_dsp *Dsp, u16 *RawSamples);
+
+/* FFT input to FftSize / 2 magnitude bins in Dsp->Spectrum */
+u32 DspCalculateSpectrum(fl_dsp *Dsp);
+
+/* Loudness of raw samples in ADC counts around their mean, cheap enough to
+ * run on every hop */
+void DspSampleLevels(const u16 *Samples, u32 NumSamples, u16 *Rms, u16 *Peak);
+
+/* Sets up NumBands mel spaced bands between MinFrequency and MaxFrequency,
+ * Weights has to hold DSP_FILTERBANK_MAX_WEIGHTS(FftSize, NumBands) */
+u32 DspBandsInit(fl_dsp *Dsp, u32 NumBands, f32 SampleRate, f32 MinFrequency, f32 MaxFrequency,
+                 fl_band *Bands, f32 *Weights);
+
+/* Weighted mean magnitude of every band, reads the last calculated spectrum */
+void DspCalculateBands(fl_dsp *Dsp, f32 *Output);
+
+/* Bins at or below this are considered noise and left out of the cumulative sum */
+#define DSP_BIN_NOISE_FLOOR DSP_BIN_FROM_F32(0.002f)
+
+/* Output[K] is the sum of the bins above the noise floor below bin K,
+ * it has to hold FftSize / 2 + 1 values */
+void DspCalculateCumulative(fl_dsp *Dsp, fl_bin_sum *Output);
+
+/* What the lights get to see of every analysed frame */
+typedef struct {
+   fl_bin *Spectrum;
+   fl_bin_sum *Cumulative;
+   u32 NumBins;
+   /* Bins of this spectrum per bin of a CONFIG_FEELIGHTS_FFT_SIZE one */
+   f32 BinScale;
+   f32 *Bands;
+   u32 NumBands;
+   struct fl_beat *Beat;
+} fl_audio_features;
+
+/* Spectrum energy between two fractional bin positions of a
+ * CONFIG_FEELIGHTS_FFT_SIZE spectrum, two lookups into the cumulative sum
+ * with the edge bins counted partially */
+f32 DspWindowEnergy(fl_audio_features *Features, f32 LoBin, f32 HiBin);
+
+#if defined(CONFIG_FEELIGHTS_DSP_ACCURACY_CHECK)
+typedef struct {
+   u32 FramesCompared;
+   f32 MaxError;
+   f32 ErrorEnergy;
+   f32 ReferenceEnergy;
+} fl_dsp_accuracy;
+
+/* Runs the float engine over the same samples and accumulates the error of
+ * the last calculated spectrum against it */
+int DspAccuracyCheck(fl_dsp *Dsp, u16 *RawSamples);
+
+void DspGetAccuracy(fl_dsp_accuracy *Accuracy);
+#endif
 
 #endif /* FL_DSP_H__ */
@@ -1,35 +1,53 @@
 #include "fl_common.h"
 #include "fl_events.h"
 #include "zephyr.h"
+#include <errno.h>
+#include <string.h>
 
 #define LOG_LEVEL 4
 #include <logging/log.h>
 LOG_MODULE_REGISTER(events);
 
-struct k_poll_signal OsSiglnals[EV_MAX_IDX];
+#define EVENTS_QUEUE_SIZE (16)
+#define EVENTS_QUEUE_MASK (EVENTS_QUEUE_SIZE - 1)
 
-struct k_poll_event OsEvents[EV_MAX_IDX];
+/* One single producer, single consumer ring per event type, so interrupts of
+ * different priorities never share a write index. The consumer merges them
+ * back into emit order by timestamp */
+typedef struct {
+   fl_event_message Messages[EVENTS_QUEUE_SIZE];
+   /* Written only by the producer */
+   volatile u32 Head;
+   /* Written only by the consumer */
+   volatile u32 Tail;
+   u32 Emitted;
+   u32 Overflows;
+   u32 MaxDepth;
+} event_queue;
+
+internal event_queue Queues[EV_MAX_IDX];
+
+/* Given once for every queued message */
+internal struct k_sem Doorbell;
 
 internal struct k_timer PeriodicTimer;
+internal u32 PeriodicCount;
 
 internal void PeriodicTimerHandler(struct k_timer * Timer)
 {
-   k_poll_signal_raise(&OsSiglnals[EV_PERIODIC_FRAME], 0);
+   fl_event_message Message = {
+      .Type = EV_PERIODIC_FRAME,
+      .Periodic.Count = ++PeriodicCount,
+   };
+
+   EventEmit(&Message);
 }
 
 
 u32 EventsInit()
 {
-   for (fl_event Event = EV_START_IDX; Event < EV_MAX_IDX; Event++)
-   {
-      k_poll_event_init(&OsEvents[Event],
-                        K_POLL_TYPE_SIGNAL,
-                        K_POLL_MODE_NOTIFY_ONLY,
-                        &OsSiglnals[Event]);
-
-      /* TODO(kleindan) errors?! */
-      k_poll_signal_init(&OsSiglnals[Event]);
-   }
+   memset(Queues, 0, sizeof(Queues));
+   k_sem_init(&Doorbell, 0, K_SEM_MAX_LIMIT);
 
    /* TODO(kleindan) errors?! */
    k_timer_init(&PeriodicTimer, PeriodicTimerHandler, 0);
@@ -39,7 +57,13 @@ u32 EventsInit()
 
 u32 EventsStartPeriodicEvent(u32 MsTimeout)
 {
-   k_timer_start(&PeriodicTimer, K_MSEC(MsTimeout), K_MSEC(MsTimeout));
+   return EventsStartPeriodicEventUs(MsTimeout * 1000);
+}
+
+u32 EventsStartPeriodicEventUs(u32 PeriodUs)
+{
+   PeriodicCount = 0;
+   k_timer_start(&PeriodicTimer, K_USEC(PeriodUs), K_USEC(PeriodUs));
    return 0;
 }
 
@@ -49,42 +73,84 @@ u32 EventsStopPeriodicEvent()
    return 0;
 }
 
-fl_event WaitForEvent(u32 TimeoutMs)
+fl_event WaitForEvent(u32 TimeoutMs, fl_event_message *Message)
 {
-   int WaitResult = 0;
    k_timeout_t Timeout = (TimeoutMs == 0) ? K_FOREVER : K_MSEC(TimeoutMs);
-   fl_event TriggeredEvent = EV_MAX_IDX;
+   event_queue *Oldest = NULL;
+
+   if (k_sem_take(&Doorbell, Timeout) != 0)
+   {
+      LOG_ERR("Unexpected polling timeout");
+      Message->Type = EV_MAX_IDX;
+      return EV_MAX_IDX;
+   }
 
-   WaitResult = k_poll(OsEvents, ArrayCount(OsEvents), Timeout);
-   switch (WaitResult) 
+   for (fl_event Event = EV_START_IDX; Event < EV_MAX_IDX; Event++)
    {
-      case 0:
-         for (fl_event Event = EV_START_IDX; Event < EV_MAX_IDX; Event++)
-         {
-            if (OsEvents[Event].state & K_POLL_STATE_SIGNALED)
-            {
-               OsEvents[Event].signal->signaled = 0;
-               OsEvents[Event].state = K_POLL_STATE_NOT_READY;
-               TriggeredEvent = Event;
-               break;
-            }
-         }
-         break;
-      case -EAGAIN:
-         LOG_ERR("Unexpected polling timeout");
-         break;
-      default:
-         LOG_ERR("Unexpected event");
-         break;
+      event_queue *Queue = &Queues[Event];
+      if (Queue->Head == Queue->Tail)
+      {
+         continue;
+      }
+      if (Oldest == NULL ||
+          (i32)(Queue->Messages[Queue->Tail & EVENTS_QUEUE_MASK].Timestamp -
+                Oldest->Messages[Oldest->Tail & EVENTS_QUEUE_MASK].Timestamp) < 0)
+      {
+         Oldest = Queue;
+      }
    }
 
-   return TriggeredEvent;
+   if (Oldest == NULL)
+   {
+      LOG_ERR("Doorbell rang for an empty queue");
+      Message->Type = EV_MAX_IDX;
+      return EV_MAX_IDX;
+   }
+
+   *Message = Oldest->Messages[Oldest->Tail & EVENTS_QUEUE_MASK];
+   /* The slot may only be reused once it has been copied out */
+   compiler_barrier();
+   Oldest->Tail++;
+
+   return Message->Type;
+}
+
+u32 EventsPending(fl_event Event)
+{
+   return Queues[Event].Head - Queues[Event].Tail;
 }
 
-u32 EventEmit(fl_event Event)
+int EventEmit(fl_event_message *Message)
 {
-   k_poll_signal_raise(&OsSiglnals[Event], 0);
+   event_queue *Queue = &Queues[Message->Type];
+   u32 Depth = Queue->Head - Queue->Tail;
+
+   if (Depth >= EVENTS_QUEUE_SIZE)
+   {
+      Queue->Overflows++;
+      return -ENOBUFS;
+   }
+
+   Message->Timestamp = k_cycle_get_32();
+   Queue->Messages[Queue->Head & EVENTS_QUEUE_MASK] = *Message;
+   /* The consumer must not see the new head before the message */
+   compiler_barrier();
+   Queue->Head++;
+
+   Queue->Emitted++;
+   Queue->MaxDepth = Maximum(Queue->MaxDepth, Depth + 1);
+   k_sem_give(&Doorbell);
 
    return 0;
 }
 
+void EventsGetStats(fl_event_stats *Stats)
+{
+   for (fl_event Event = EV_START_IDX; Event < EV_MAX_IDX; Event++)
+   {
+      Stats->Emitted[Event] = Queues[Event].Emitted;
+      Stats->Overflows[Event] = Queues[Event].Overflows;
+      Stats->Depth[Event] = EventsPending(Event);
+      Stats->MaxDepth[Event] = Queues[Event].MaxDepth;
+   }
+}
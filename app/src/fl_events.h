@@ -3,6 +3,8 @@
 
 #include <zephyr.h>
 #include <kernel.h>
+#include <stdbool.h>
+#include "fl_common.h"
 
 typedef enum {
    EV_START_IDX = 0,
@@ -13,16 +15,52 @@ typedef enum {
    EV_MAX_IDX,
 } fl_event;
 
-extern struct k_poll_signal OsSiglnals[EV_MAX_IDX];
+typedef struct {
+   fl_event Type;
+   /* k_cycle_get_32() when the event was emitted */
+   u32 Timestamp;
+   union {
+      /* The capture half that was just filled */
+      struct {
+         u32 Half;
+         u32 Sequence;
+      } Audio;
+      struct {
+         bool Pressed;
+      } Button;
+      struct {
+         u32 Count;
+      } Periodic;
+   };
+} fl_event_message;
+
+typedef struct {
+   u32 Emitted[EV_MAX_IDX];
+   u32 Overflows[EV_MAX_IDX];
+   u32 Depth[EV_MAX_IDX];
+   u32 MaxDepth[EV_MAX_IDX];
+} fl_event_stats;
 
 u32 EventsInit();
 
-fl_event WaitForEvent(u32 TimeoutMs);
+/* Takes the oldest queued event of any type, returns EV_MAX_IDX if none came
+ * in within TimeoutMs (0 waits forever) */
+fl_event WaitForEvent(u32 TimeoutMs, fl_event_message *Message);
+
+/* Events of this type queued behind the ones already taken */
+u32 EventsPending(fl_event Event);
 
 u32 EventsStopPeriodicEvent();
 
 u32 EventsStartPeriodicEvent(u32 MsTimeout);
 
-u32 EventEmit(fl_event Event);
+/* Rounded up to the kernel tick */
+u32 EventsStartPeriodicEventUs(u32 PeriodUs);
+
+/* Safe from interrupts, but every event type may only be emitted from one
+ * context at a time. Returns -ENOBUFS if the queue of the type is full */
+int EventEmit(fl_event_message *Message);
+
+void EventsGetStats(fl_event_stats *Stats);
 
 #endif
@@ -1,12 +1,16 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
 #include "fl_common.h"
+#include "fl_beat.h"
 #include "fl_lights.h"
+#include "fl_memory.h"
 
 #define LOG_LEVEL 4
 #include <logging/log.h>
 LOG_MODULE_REGISTER(lights);
 
 #define MIN_ORB_X (5.0f)
-#define MAX_ORB_X (123.0f)
 #define MIN_ORB_R (5.0f)
 #define MAX_ORB_R (10.0f)
 #define MIN_ORB_FREQ_IDX (3.0f)
@@ -14,11 +18,35 @@ LOG_MODULE_REGISTER(lights);
 #define MIN_ORB_FREQ_R (1.0f)
 #define MAX_ORB_FREQ_R (5.0f - MIN_ORB_FREQ_R)
 
-typedef struct {
-   f32 R;
-   f32 G;
-   f32 B;
-} fl_color;
+/* Decay constants were tuned for one frame per 1024 samples at 40 kHz */
+#define REFERENCE_FRAME_RATE (40000.0f / 1024.0f)
+#define ORB_DECAY (0.7f)
+#define AMBIENT_DECAY (0.9f)
+#define FLASH_DECAY (0.5f)
+
+#define BAND_THRESHOLD (0.002f)
+/* Share of the orbs following a whole band, the rest watch a narrow window of bins */
+#define BAND_ORB_RATIO (0.75f)
+
+#define PIXEL_MAX_CHANNEL (250)
+#define PIXEL_SHIFT_R (offsetof(struct led_rgb, r) * 8)
+#define PIXEL_SHIFT_G (offsetof(struct led_rgb, g) * 8)
+#define PIXEL_SHIFT_B (offsetof(struct led_rgb, b) * 8)
+
+/* A beat flashes the base color of the palette at this intensity, weighed by
+ * how sure the tracker is, beats between downbeats at half of it */
+#define FLASH_INTENSITY (255.0f)
+#define FLASH_OFFBEAT_LEVEL (0.5f)
+
+/* The idle ambient breathes between these intensities once per period */
+#define IDLE_MIN_INTENSITY (4.0f)
+#define IDLE_MAX_INTENSITY (20.0f)
+#define IDLE_PERIOD_S (8.0f)
+
+#if defined(CONFIG_FEELIGHTS_LIGHTS_Q8)
+/* Pixels under the widest orb, 2 * (MIN_ORB_R + MAX_ORB_R) rounded up */
+#define ORB_FOOTPRINT_MAX (32)
+#endif
 
 typedef struct {
    fl_color Base;
@@ -28,81 +56,246 @@ typedef struct {
 typedef enum {
    none,
    spectrum_window,
+   band_energy,
 } controller_algo_t;
 
-typedef struct {
-   f32 PFreq;
-   f32 RFreq;
-   f32 IntensityMultiplier;
-} algo_spectrum_window_t;
-
-typedef struct {
-   controller_algo_t Algo;
-   union {
-      algo_spectrum_window_t SpectrumWindow;
-   } Data;
-} controller_t ;
-
-typedef struct 
-{
-   f32 P;
-   f32 dP;
-   f32 R;
-   f32 dR;
-   f32 Intensity;
-   fl_color Color;
-   controller_t Controller;
-} fl_orb;
-
 typedef struct
 {
    fl_color Color;
    f32 Intensity;
+   f32 PreviousIntensity;
    f32 IntensityMultiplier;
-   f32 PFreq;
-   f32 RFreq;
+   u32 FirstBand;
+   u32 NumBands;
 } fl_ambient;
 
 
-#define MAX_ORBS (4)
+#define MAX_ORBS (CONFIG_FEELIGHTS_MAX_ORBS)
+
+/* Bins are a power of two compositor tiles wide, wider on strips longer
+ * than MAX_BINS tiles */
+#define MAX_BINS (128)
+/* A binned span is at most 2 * (MIN_ORB_R + MAX_ORB_R) + 1 pixels, never
+ * more than one tile, so it falls into two bins at most */
+#define MAX_BIN_ENTRIES (2 * MAX_ORBS)
+
+/* Orb state as one array per field, the orbs following the same controller
+ * are updated in one batch */
+internal struct
+{
+   f32 P[MAX_ORBS];
+   f32 R[MAX_ORBS];
+   f32 Intensity[MAX_ORBS];
+   /* Intensity at the update before, frames rendered in between blend from
+    * it. Orbs only move when they are placed */
+   f32 PreviousIntensity[MAX_ORBS];
+   f32 ColorR[MAX_ORBS];
+   f32 ColorG[MAX_ORBS];
+   f32 ColorB[MAX_ORBS];
+   controller_algo_t Algo[MAX_ORBS];
+   f32 IntensityMultiplier[MAX_ORBS];
+   /* band_energy */
+   u16 Band[MAX_ORBS];
+   /* spectrum_window */
+   f32 PFreq[MAX_ORBS];
+   f32 RFreq[MAX_ORBS];
+#if defined(CONFIG_FEELIGHTS_LIGHTS_Q8)
+   /* Q16.16 falloff of every pixel under the orb, starting at FirstPixel */
+   i32 FirstPixel[MAX_ORBS];
+   u32 FootprintSize[MAX_ORBS];
+   u32 Footprint[MAX_ORBS][ORB_FOOTPRINT_MAX];
+#endif
+} Orbs FL_CCM;
 
-internal fl_orb Orbs[MAX_ORBS];
+/* Indices of the orbs of every controller */
+internal struct
+{
+   u16 Band[MAX_ORBS];
+   u32 NumBand;
+   u16 Window[MAX_ORBS];
+   u32 NumWindow;
+} Batches FL_CCM;
+
+/* The orbs overlapping every bin of pixels, Orbs[Start[I]] up to
+ * Orbs[Start[I + 1]] for bin I */
+internal struct
+{
+   u32 Shift;
+   u16 Start[MAX_BINS + 1];
+   u16 Orbs[MAX_BIN_ENTRIES];
+} Bins FL_CCM;
+
+/* What LightsRender draws, blended once per frame */
+#if defined(CONFIG_FEELIGHTS_LIGHTS_Q8)
+internal struct
+{
+   /* Q16 color channels */
+   u32 R[MAX_ORBS];
+   u32 G[MAX_ORBS];
+   u32 B[MAX_ORBS];
+} Draw FL_CCM;
+#else
+internal struct
+{
+   f32 Intensity[MAX_ORBS];
+} Draw FL_CCM;
+#endif
 
-internal fl_ambient Ambient;
+/* Orbs updated and rendered, the rest keep their state */
+internal u32 NumOrbs = MAX_ORBS;
 
-internal fl_palette Palette[4];
+/* Every random choice of the lights comes from here, so a seed replays a show */
+internal u32 RandomState = 1;
 
-internal void log_orb(fl_orb *Orb)
+internal inline f32 Random()
 {
-   LOG_INF("P %4f, R %f, RGB: %4f, %4f, %4f, PF %4f, RF, %4f, I %4f",
-         Orb->P,
-         Orb->R,
-         Orb->Color.R,
-         Orb->Color.G,
-         Orb->Color.B,
-         Orb->Controller.Data.SpectrumWindow.PFreq,
-         Orb->Controller.Data.SpectrumWindow.RFreq,
-         Orb->Controller.Data.SpectrumWindow.IntensityMultiplier
-         );
+   return RandomUnit(&RandomState);
 }
-internal inline void create_orb(fl_orb *Orb)
+
+internal fl_ambient Ambient FL_CCM;
+
+internal struct
+{
+   f32 Level;
+   f32 PreviousLevel;
+} Flash FL_CCM;
+
+internal fl_palette Palette[4] FL_CCM;
+
+internal struct
+{
+   f32 OrbDecay;
+   f32 AmbientDecay;
+   f32 FlashDecay;
+   f32 ResetScale;
+} Timing FL_CCM;
+
+internal u32 ResetCount;
+/* Set once ResetCount ran out, the frame rendered from that update still
+ * shows the old orbs */
+internal bool ResetPending;
+
+internal u32 NumBands;
+
+/* Skipped when the frame time is short */
+internal bool AmbientEnabled = true;
+
+/* Orbs are placed anywhere from MIN_ORB_X over this many pixels */
+internal f32 OrbSpan;
+
+#if defined(CONFIG_FEELIGHTS_LIGHTS_Q8)
+/* Same pixel span and 1 + R^2 - d^2 falloff as the float renderer, worked out
+ * once when the orb is placed instead of for every frame */
+internal void OrbFootprint(u32 Orb)
 {
-   Orb->P = MIN_ORB_X + MAX_ORB_X * Random();
-   Orb->dP = 0.0f;
-   Orb->R = MIN_ORB_R + MAX_ORB_R * Random();
-   Orb->dR = 0.0f;
-   Orb->Controller.Algo = spectrum_window;
-   Orb->Controller.Data.SpectrumWindow.PFreq = MIN_ORB_FREQ_IDX + MAX_ORB_FREQ_IDX * Random();
-   Orb->Controller.Data.SpectrumWindow.RFreq = MIN_ORB_FREQ_R + MAX_ORB_FREQ_R * Random();
-   Orb->Controller.Data.SpectrumWindow.IntensityMultiplier = 100.0f + 140.0f * Random();
+   f32 OrbP = Orbs.P[Orb];
+   f32 P = ceil(OrbP - Orbs.R[Orb]);
+   i32 MaxI = (i32)floor(OrbP + Orbs.R[Orb]);
+   f32 OrbRadiusSq = Square(Orbs.R[Orb]);
+   u32 Size = 0;
+
+   Orbs.FirstPixel[Orb] = (i32)P;
+   for (i32 I = Orbs.FirstPixel[Orb]; I < MaxI && Size < ORB_FOOTPRINT_MAX; ++I, P += 1.0f)
+   {
+      f32 Rate = 1.0f - (Square(P - OrbP) - OrbRadiusSq);
+      Orbs.Footprint[Orb][Size++] = (u32)Round(Rate * 65536.0f);
+   }
+   Orbs.FootprintSize[Orb] = Size;
 }
+#endif
 
-internal inline void RandomizeOrbs()
+internal inline void create_orb(u32 Orb)
 {
-   for (i32 I = 0; I < MAX_ORBS; ++I)
+   Orbs.P[Orb] = MIN_ORB_X + OrbSpan * Random();
+   Orbs.R[Orb] = MIN_ORB_R + MAX_ORB_R * Random();
+#if defined(CONFIG_FEELIGHTS_LIGHTS_Q8)
+   OrbFootprint(Orb);
+#endif
+   if (Random() < BAND_ORB_RATIO)
    {
-      create_orb(&Orbs[I]);
+      Orbs.Algo[Orb] = band_energy;
+      Orbs.Band[Orb] = (u16)Minimum((u32)(NumBands * Random()), NumBands - 1);
+      Orbs.IntensityMultiplier[Orb] = 100.0f + 140.0f * Random();
+      return;
    }
+   Orbs.Algo[Orb] = spectrum_window;
+   Orbs.PFreq[Orb] = MIN_ORB_FREQ_IDX + MAX_ORB_FREQ_IDX * Random();
+   Orbs.RFreq[Orb] = MIN_ORB_FREQ_R + MAX_ORB_FREQ_R * Random();
+   Orbs.IntensityMultiplier[Orb] = 100.0f + 140.0f * Random();
+}
+
+internal inline u32 BinOf(i32 Pixel)
+{
+   return Minimum((u32)Maximum(Pixel, 0) >> Bins.Shift, MAX_BINS - 1);
+}
+
+/* Orbs only move when they are placed, so they are binned then */
+internal inline u32 FirstBinOf(u32 Orb)
+{
+   return BinOf((i32)ceil(Orbs.P[Orb] - Orbs.R[Orb]));
+}
+
+internal inline u32 LastBinOf(u32 Orb)
+{
+   return BinOf((i32)floor(Orbs.P[Orb] + Orbs.R[Orb]));
+}
+
+internal void BinOrbs()
+{
+   u32 Extent = (u32)(MIN_ORB_X + OrbSpan + MIN_ORB_R + MAX_ORB_R) + 1;
+   u16 Fill[MAX_BINS];
+
+   Bins.Shift = COMPOSE_TILE_SHIFT;
+   while ((Extent >> Bins.Shift) >= MAX_BINS)
+   {
+      Bins.Shift++;
+   }
+
+   /* Count, turn the counts into starts, then fill */
+   memset(Bins.Start, 0, sizeof(Bins.Start));
+   for (u32 I = 0; I < NumOrbs; ++I)
+   {
+      for (u32 Bin = FirstBinOf(I); Bin <= LastBinOf(I); ++Bin)
+      {
+         Bins.Start[Bin + 1]++;
+      }
+   }
+   for (u32 Bin = 0; Bin < MAX_BINS; ++Bin)
+   {
+      Bins.Start[Bin + 1] += Bins.Start[Bin];
+   }
+   memcpy(Fill, Bins.Start, sizeof(Fill));
+   for (u32 I = 0; I < NumOrbs; ++I)
+   {
+      for (u32 Bin = FirstBinOf(I); Bin <= LastBinOf(I); ++Bin)
+      {
+         Bins.Orbs[Fill[Bin]++] = (u16)I;
+      }
+   }
+}
+
+/* Places the orbs from First on, the ones before it stay where they are */
+internal inline void RandomizeOrbs(u32 First)
+{
+   for (u32 I = First; I < NumOrbs; ++I)
+   {
+      create_orb(I);
+   }
+
+   Batches.NumBand = 0;
+   Batches.NumWindow = 0;
+   for (u32 I = 0; I < NumOrbs; ++I)
+   {
+      if (Orbs.Algo[I] == band_energy)
+      {
+         Batches.Band[Batches.NumBand++] = (u16)I;
+      }
+      else
+      {
+         Batches.Window[Batches.NumWindow++] = (u16)I;
+      }
+   }
+   BinOrbs();
 }
 
 internal void ApplyPalette(fl_palette *Palette)
@@ -111,11 +304,11 @@ internal void ApplyPalette(fl_palette *Palette)
    Ambient.Color.G = Palette->Base.G;
    Ambient.Color.B = Palette->Base.B;
 
-   for (i32 I = 0; I < MAX_ORBS; ++I)
+   for (u32 I = 0; I < MAX_ORBS; ++I)
    {
-      Orbs[I].Color.R = Palette->Accents[I % 3].R;
-      Orbs[I].Color.G = Palette->Accents[I % 3].G;
-      Orbs[I].Color.B = Palette->Accents[I % 3].B;
+      Orbs.ColorR[I] = Palette->Accents[I % 3].R;
+      Orbs.ColorG[I] = Palette->Accents[I % 3].G;
+      Orbs.ColorB[I] = Palette->Accents[I % 3].B;
    }
 }
 
@@ -146,119 +339,335 @@ void MakePalette(fl_palette * Palette, u32 Base, u32 Accent1, u32 Accent2, u32 A
    Palette->Accents[2].B = (f32)((Accent3 >>  0) & 0xFF) * BFactor;
 }
 
-u32 LightsInit()
+u32 LightsInit(f32 FrameRate, u32 NumOfBands, u32 NumPixels, u32 Seed)
 {
+   /* xorshift never leaves 0 */
+   RandomState = Seed ? Seed : 1;
+   NumBands = NumOfBands;
+   OrbSpan = (f32)NumPixels;
+
+   LightsSetFrameRate(FrameRate);
+   ResetCount = (u32)(100 * Timing.ResetScale);
+   ResetPending = false;
+
    MakePalette(&Palette[0], 0xFABEC0, 0xF85C70, 0xF37970, 0xE43D40);
    MakePalette(&Palette[1], 0x32CD30, 0x2C5E1A, 0x1A4314, 0xB2D2A4);
    MakePalette(&Palette[2], 0x6AABD2, 0xB7CFDC, 0x385E72, 0xD9E4EC);
    MakePalette(&Palette[3], 0x5D59AF, 0x6AABD2, 0xBE81B6, 0xE390C8);
    ApplyPalette(&Palette[0]);
 
-   RandomizeOrbs();
+   RandomizeOrbs(0);
 
    Ambient.Intensity = 0.0f;
-   Ambient.PFreq = 5.0f;
-   Ambient.RFreq = 4.0f;
+   /* The bass end of the spectrum, roughly what used to be bins 1 to 8 */
+   Ambient.FirstBand = 0;
+   Ambient.NumBands = Maximum(NumBands / 8, 1);
    Ambient.IntensityMultiplier = 90.0f;
+   Flash.Level = 0.0f;
+   Flash.PreviousLevel = 0.0f;
 
    return 0;
 }
 
+void LightsSetFrameRate(f32 FrameRate)
+{
+   f32 FrameRateRatio = REFERENCE_FRAME_RATE / FrameRate;
+
+   Timing.OrbDecay = powf(ORB_DECAY, FrameRateRatio);
+   Timing.AmbientDecay = powf(AMBIENT_DECAY, FrameRateRatio);
+   Timing.FlashDecay = powf(FLASH_DECAY, FrameRateRatio);
+   Timing.ResetScale = 1.0f / FrameRateRatio;
+}
+
+u32 LightsGetOrbs(fl_orb_state *States, u32 MaxOrbs)
+{
+   for (u32 I = 0; I < Minimum(MaxOrbs, NumOrbs); ++I)
+   {
+      States[I].P = Orbs.P[I];
+      States[I].R = Orbs.R[I];
+      States[I].Intensity = Orbs.Intensity[I];
+      States[I].Color.R = Orbs.ColorR[I];
+      States[I].Color.G = Orbs.ColorG[I];
+      States[I].Color.B = Orbs.ColorB[I];
+   }
+
+   return NumOrbs;
+}
+
+f32 LightsGetAmbientIntensity()
+{
+   return Ambient.Intensity;
+}
+
+fl_color LightsGetAmbientColor()
+{
+   return Ambient.Color;
+}
+
+void LightsSetLength(u32 NumPixels)
+{
+   OrbSpan = (f32)NumPixels;
+   RandomizeOrbs(0);
+}
+
+u32 LightsSetOrbCount(u32 Count)
+{
+   u32 Previous = NumOrbs;
+
+   NumOrbs = Minimum(Maximum(Count, 1), MAX_ORBS);
+   RandomizeOrbs(Minimum(Previous, NumOrbs));
+
+   return NumOrbs;
+}
+
+void LightsSetAmbient(bool Enabled)
+{
+   AmbientEnabled = Enabled;
+}
+
+internal inline u32 PackColor(u32 R, u32 G, u32 B)
+{
+   return (R << PIXEL_SHIFT_R) | (G << PIXEL_SHIFT_G) | (B << PIXEL_SHIFT_B);
+}
 
+internal inline u32 ScaleColor(const fl_color *Color, f32 Intensity)
+{
+   return PackColor(Minimum((u32)(Color->R * Intensity), 0xFF),
+                    Minimum((u32)(Color->G * Intensity), 0xFF),
+                    Minimum((u32)(Color->B * Intensity), 0xFF));
+}
 
-void LightsUpdateAndRender(pixel *Pixels, u32 NumPixels, f32 *Spectrum, u32 NumSamples)
+#if defined(CONFIG_FEELIGHTS_LIGHTS_Q8)
+/* Q16 color times Q16.16 falloff, the channel value is the high word of the
+ * 64 bit product (a single UMULL) */
+internal inline u32 ScaleChannel(u32 Color, u32 Rate)
 {
-   static u32 ResetCount = 100;
+   return Minimum((u32)(((u64)Color * Rate) >> 32), 0xFF);
+}
 
-   for (size_t i = 0; i < NumPixels; ++i)
+/* Channels are added with saturation at 255 and only limited to
+ * PIXEL_MAX_CHANNEL once all layers are in, which gives the same result as
+ * clamping after every orb */
+internal void PrepareDraw(f32 Blend)
+{
+   for (u32 I = 0; I < NumOrbs; ++I)
    {
-      Pixels[i].Dword = 0;
+      f32 Intensity = Lerp(Orbs.PreviousIntensity[I], Blend, Orbs.Intensity[I]);
+      Draw.R[I] = (u32)Round(Orbs.ColorR[I] * Intensity * 65536.0f);
+      Draw.G[I] = (u32)Round(Orbs.ColorG[I] * Intensity * 65536.0f);
+      Draw.B[I] = (u32)Round(Orbs.ColorB[I] * Intensity * 65536.0f);
    }
+}
 
-   for (u32 IOrb = 0; IOrb < MAX_ORBS; ++IOrb)
+/* Adds the orb to the Count pixels of Tile, which start at pixel First */
+internal void RenderOrb(pixel *Tile, i32 First, u32 Count, u32 Orb)
+{
+   i32 Offset = First - Orbs.FirstPixel[Orb];
+   u32 I = (u32)Maximum(Offset, 0);
+   i32 End = Minimum((i32)Orbs.FootprintSize[Orb], Offset + (i32)Count);
+   const u32 *Footprint = Orbs.Footprint[Orb];
+   u32 R = Draw.R[Orb];
+   u32 G = Draw.G[Orb];
+   u32 B = Draw.B[Orb];
+
+   for ( ; (i32)I < End; ++I)
    {
-      fl_orb * Orb = &Orbs[IOrb];
+      u32 Rate = Footprint[I];
+      u32 Color = PackColor(ScaleChannel(R, Rate), ScaleChannel(G, Rate), ScaleChannel(B, Rate));
+      pixel *Pixel = &Tile[(i32)I - Offset];
+      Pixel->Dword = PackedAddSaturate(Pixel->Dword, Color);
+   }
+}
 
-      switch (Orb->Controller.Algo)
-      {
-         case spectrum_window:
-            {
-               algo_spectrum_window_t * Window = &Orb->Controller.Data.SpectrumWindow;
-               f32 Intensity = 0.0f;
-               i32 IFreq = (i32)ceil(Window->PFreq - Window->RFreq);
-               i32 MaxIFreq = (i32)floor(Window->PFreq + Window->RFreq);
-               IFreq = IFreq < 0 ? 0 : IFreq;
-               MaxIFreq = MaxIFreq >= NumSamples ? NumSamples : MaxIFreq;
-
-               for ( ; IFreq < MaxIFreq; IFreq++)
-               {
-                  if (Spectrum[IFreq] > 0.002f)
-                  {
-                     Intensity += Spectrum[IFreq];
-                  }
-               }
-               Intensity /= 2.0f * Window->RFreq;
-               Orb->Intensity = Clamp(Orb->Intensity * 0.7f, Intensity * Window->IntensityMultiplier, 255.0f);
-            }
-            break;
-         case none:
-         default:
-            break;
+#else
+internal void PrepareDraw(f32 Blend)
+{
+   for (u32 I = 0; I < NumOrbs; ++I)
+   {
+      Draw.Intensity[I] = Lerp(Orbs.PreviousIntensity[I], Blend, Orbs.Intensity[I]);
+   }
+}
 
-      }
-      f32 P = ceil(Orb->P - Orb->R);
-      i32 MaxI = (i32)floor(Orb->P + Orb->R);
-      i32 I = (i32)P;
-      I = I < 0 ? 0 : I;
-      MaxI = MaxI >= NumPixels ? NumPixels : MaxI;
-      f32 OrbRadiusSq = Square(Orb->R);
-      for ( ; I < MaxI; ++I, P += 1.0f)
-      {
-         f32 DistSq = Square(P - Orb->P);
-         f32 Rate = 1.0f - (DistSq - OrbRadiusSq);
-         f32 Intensity = Rate * Orb->Intensity;
-         Pixels[I].Color.r = ClampU(0, Pixels[I].Color.r + (u32)(Orb->Color.R * Intensity), 250);
-         Pixels[I].Color.g = ClampU(0, Pixels[I].Color.g + (u32)(Orb->Color.G * Intensity), 250);
-         Pixels[I].Color.b = ClampU(0, Pixels[I].Color.b + (u32)(Orb->Color.B * Intensity), 250);
+/* Adds the orb to the Count pixels of Tile, which start at pixel First */
+internal void RenderOrb(pixel *Tile, i32 First, u32 Count, u32 Orb)
+{
+   f32 OrbP = Orbs.P[Orb];
+   f32 OrbR = Orbs.R[Orb];
+   f32 OrbIntensity = Draw.Intensity[Orb];
+   f32 ColorR = Orbs.ColorR[Orb];
+   f32 ColorG = Orbs.ColorG[Orb];
+   f32 ColorB = Orbs.ColorB[Orb];
+   i32 I = Maximum((i32)ceil(OrbP - OrbR), First);
+   i32 MaxI = Minimum((i32)floor(OrbP + OrbR), First + (i32)Count);
+   f32 OrbRadiusSq = Square(OrbR);
+   f32 P = (f32)I;
+
+   for ( ; I < MaxI; ++I, P += 1.0f)
+   {
+      pixel *Pixel = &Tile[I - First];
+      f32 DistSq = Square(P - OrbP);
+      f32 Rate = 1.0f - (DistSq - OrbRadiusSq);
+      f32 Intensity = Rate * OrbIntensity;
+      Pixel->Color.r = ClampU(0, Pixel->Color.r + (u32)(ColorR * Intensity), PIXEL_MAX_CHANNEL);
+      Pixel->Color.g = ClampU(0, Pixel->Color.g + (u32)(ColorG * Intensity), PIXEL_MAX_CHANNEL);
+      Pixel->Color.b = ClampU(0, Pixel->Color.b + (u32)(ColorB * Intensity), PIXEL_MAX_CHANNEL);
+   }
+}
 
-      }
+#endif
+
+internal u32 PrepareOrbs(fl_layer *Layer, f32 Blend)
+{
+   PrepareDraw(Blend);
+
+   return 256;
+}
+
+/* Only the orbs binned to the pixels, a tile never crosses a bin */
+internal void RenderOrbs(pixel *Tile, u32 First, u32 Count)
+{
+   u32 Bin = BinOf((i32)First);
+
+   for (u32 Entry = Bins.Start[Bin]; Entry < Bins.Start[Bin + 1]; ++Entry)
+   {
+      RenderOrb(Tile, (i32)First, Count, Bins.Orbs[Entry]);
    }
-   
+}
+
+internal u32 PrepareAmbient(fl_layer *Layer, f32 Blend)
+{
+   if (!AmbientEnabled)
    {
-      f32 Intensity = 0.0f;
-      i32 IFreq = (i32)ceil(Ambient.PFreq - Ambient.RFreq);
-      i32 MaxIFreq = (i32)floor(Ambient.PFreq + Ambient.RFreq);
-      IFreq = IFreq < 0 ? 0 : IFreq;
-      MaxIFreq = MaxIFreq >= NumSamples ? NumSamples : MaxIFreq;
+      return 0;
+   }
+   Layer->Color = ScaleColor(&Ambient.Color, Lerp(Ambient.PreviousIntensity, Blend, Ambient.Intensity));
 
-      for ( ; IFreq < MaxIFreq; IFreq++)
+   return Layer->Color ? 256 : 0;
+}
+
+internal u32 PrepareFlash(fl_layer *Layer, f32 Blend)
+{
+   f32 Level = Lerp(Flash.PreviousLevel, Blend, Flash.Level);
+
+   Layer->Color = ScaleColor(&Ambient.Color, FLASH_INTENSITY);
+
+   return (u32)Round(Clamp(0.0f, Level, 1.0f) * 256.0f);
+}
+
+typedef enum {
+   LAYER_ORBS,
+   LAYER_AMBIENT,
+   LAYER_FLASH,
+   LAYER_MAX_IDX,
+} layer_idx;
+
+/* From the bottom up, the ambient only fills in where the orbs left it dark */
+internal fl_layer Layers[LAYER_MAX_IDX] = {
+   [LAYER_ORBS] = { "orbs", BLEND_ADD, 255, PrepareOrbs, RenderOrbs },
+   [LAYER_AMBIENT] = { "ambient", BLEND_FILL, 255, PrepareAmbient, NULL },
+   [LAYER_FLASH] = { "flash", BLEND_ADD, CONFIG_FEELIGHTS_FLASH_OPACITY, PrepareFlash, NULL },
+};
+
+u32 LightsGetLayers(const fl_layer **Stack)
+{
+   *Stack = Layers;
+
+   return LAYER_MAX_IDX;
+}
+
+int LightsSetLayer(const char *Name, fl_blend_mode Mode, u32 Opacity)
+{
+   for (u32 I = 0; I < LAYER_MAX_IDX; ++I)
+   {
+      if (strcmp(Layers[I].Name, Name) == 0 && Mode < BLEND_MAX_IDX)
       {
-         if (Spectrum[IFreq] > 0.002f)
-         {
-            Intensity += Spectrum[IFreq];
-         }
+         Layers[I].Mode = Mode;
+         Layers[I].Opacity = Minimum(Opacity, 255);
+         return 0;
       }
-      Intensity /= 2.0f * Ambient.RFreq;
-      Ambient.Intensity = Clamp(Maximum(Ambient.Intensity * 0.9f, 20.0f), Intensity * Ambient.IntensityMultiplier, 255.0f);
+   }
+
+   LOG_ERR("No layer %s or blend mode %u", Name, Mode);
+   return -EINVAL;
+}
+
+/* Only the ambient color, the orbs are left as they are for when the music
+ * comes back */
+void LightsRenderIdle(pixel *Pixels, u32 NumPixels, f32 Seconds)
+{
+   const f32 TwoPi = 6.2831853f;
+   /* A cosine, starting and ending every period at the dimmest */
+   f32 Breath = 0.5f - 0.5f * Sine(TwoPi * Seconds / IDLE_PERIOD_S + TwoPi / 4.0f);
+   u32 Limit = PackColor(PIXEL_MAX_CHANNEL, PIXEL_MAX_CHANNEL, PIXEL_MAX_CHANNEL);
+   u32 Color;
+
+   Ambient.Intensity = IDLE_MIN_INTENSITY + (IDLE_MAX_INTENSITY - IDLE_MIN_INTENSITY) * Breath;
+   Ambient.PreviousIntensity = Ambient.Intensity;
+   Color = PackedMinimum(ScaleColor(&Ambient.Color, Ambient.Intensity), Limit);
+   for (u32 I = 0; I < NumPixels; ++I)
+   {
+      Pixels[I].Dword = Color;
+   }
+}
+
+void LightsUpdate(fl_audio_features *Features)
+{
+   if (ResetPending)
+   {
+      static u32 PaletteIndex = 0;
+      RandomizeOrbs(0);
+      ApplyPalette(&Palette[++PaletteIndex & 0x3]);
+      ResetCount = (u32)((50 + (RandomNext(&RandomState) & 0x0FF)) * Timing.ResetScale);
+      ResetPending = false;
+   }
 
-      for (i32 I = 0; I < NumPixels; ++I)
+   for (u32 I = 0; I < NumOrbs; ++I)
+   {
+      Orbs.PreviousIntensity[I] = Orbs.Intensity[I];
+   }
+
+   for (u32 K = 0; K < Batches.NumBand; ++K)
+   {
+      u32 I = Batches.Band[K];
+      f32 Intensity = Features->Bands[Orbs.Band[I]];
+      Intensity = Intensity > BAND_THRESHOLD ? Intensity : 0.0f;
+      Orbs.Intensity[I] = Clamp(Orbs.Intensity[I] * Timing.OrbDecay, Intensity * Orbs.IntensityMultiplier[I], 255.0f);
+   }
+
+   for (u32 K = 0; K < Batches.NumWindow; ++K)
+   {
+      u32 I = Batches.Window[K];
+      f32 Intensity = DspWindowEnergy(Features, Orbs.PFreq[I] - Orbs.RFreq[I], Orbs.PFreq[I] + Orbs.RFreq[I]);
+      Intensity /= 2.0f * Orbs.RFreq[I];
+      Orbs.Intensity[I] = Clamp(Orbs.Intensity[I] * Timing.OrbDecay, Intensity * Orbs.IntensityMultiplier[I], 255.0f);
+   }
+   
+   Ambient.PreviousIntensity = Ambient.Intensity;
+   if (AmbientEnabled)
+   {
+      f32 Intensity = 0.0f;
+      for (u32 IBand = Ambient.FirstBand; IBand < Ambient.FirstBand + Ambient.NumBands; ++IBand)
       {
-         u32 CurrentIntensity = Pixels[I].Color.r + Pixels[I].Color.g + Pixels[I].Color.b;
-         if (CurrentIntensity < 50)
+         if (Features->Bands[IBand] > BAND_THRESHOLD)
          {
-            Pixels[I].Color.r = ClampU(0, Pixels[I].Color.r + (u32)(Ambient.Color.R * Ambient.Intensity), 250);
-            Pixels[I].Color.g = ClampU(0, Pixels[I].Color.g + (u32)(Ambient.Color.G * Ambient.Intensity), 250);
-            Pixels[I].Color.b = ClampU(0, Pixels[I].Color.b + (u32)(Ambient.Color.B * Ambient.Intensity), 250);
+            Intensity += Features->Bands[IBand];
          }
       }
+      Intensity /= (f32)Ambient.NumBands;
+      Ambient.Intensity = Clamp(Maximum(Ambient.Intensity * Timing.AmbientDecay, 20.0f), Intensity * Ambient.IntensityMultiplier, 255.0f);
+   }
+
+   Flash.PreviousLevel = Flash.Level;
+   Flash.Level *= Timing.FlashDecay;
+   if (Features->Beat && Features->Beat->Beat)
+   {
+      f32 Level = Features->Beat->Confidence * (Features->Beat->Downbeat ? 1.0f : FLASH_OFFBEAT_LEVEL);
+      Flash.Level = Maximum(Flash.Level, Level);
    }
 
    if (--ResetCount == 0)
    {
-      static u32 PaletteIndex = 0;
-      RandomizeOrbs();
-      ApplyPalette(&Palette[++PaletteIndex & 0x3]);
-      ResetCount = 50 + (sys_rand32_get() & 0x0FF);
+      ResetPending = true;
    }
 
 #if 0
@@ -266,13 +675,26 @@ void LightsUpdateAndRender(pixel *Pixels, u32 NumPixels, f32 *Spectrum, u32 NumS
    if (DebugCount++ > 100)
    {
       LOG_INF("I1: %7d, I2: %7d, I3 %7d, I4 %7d", 
-            (i32)(Orbs[0].Intensity * 1000.0f),
-            (i32)(Orbs[1].Intensity * 1000.0f),
-            (i32)(Orbs[2].Intensity * 1000.0f),
-            (i32)(Orbs[3].Intensity * 1000.0f));
+            (i32)(Orbs.Intensity[0] * 1000.0f),
+            (i32)(Orbs.Intensity[1] * 1000.0f),
+            (i32)(Orbs.Intensity[2] * 1000.0f),
+            (i32)(Orbs.Intensity[3] * 1000.0f));
       DebugCount = 0;
    }
 #endif
 
 }
 
+void LightsRender(pixel *Pixels, u32 NumPixels, f32 Blend)
+{
+   u32 Limit = PackColor(PIXEL_MAX_CHANNEL, PIXEL_MAX_CHANNEL, PIXEL_MAX_CHANNEL);
+
+   ComposeRender(Layers, LAYER_MAX_IDX, Blend, Limit, Pixels, NumPixels);
+}
+
+void LightsUpdateAndRender(pixel *Pixels, u32 NumPixels, fl_audio_features *Features)
+{
+   LightsUpdate(Features);
+   LightsRender(Pixels, NumPixels, 1.0f);
+}
+
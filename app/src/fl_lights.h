@@ -3,9 +3,73 @@
 
 #include "fl_common.h"
 #include "fl_strip.h"
+#include "fl_dsp.h"
+#include "fl_compose.h"
+#include <stdbool.h>
 
-u32 LightsInit();
+/* FrameRate is how many times per second LightsUpdateAndRender will be called,
+ * NumOfBands the number of filterbank bands in the features it gets. The same
+ * Seed and features give the same frames */
+u32 LightsInit(f32 FrameRate, u32 NumOfBands, u32 NumPixels, u32 Seed);
 
-void LightsUpdateAndRender(pixel *Pixels, u32 NumPixels, f32 *Spectrum, u32 NumSamples);
+/* For when LightsUpdateAndRender ends up being called at another rate, the
+ * orbs and the ambient fade at the same speed */
+void LightsSetFrameRate(f32 FrameRate);
+
+/* Spreads the orbs over a strip that changed length */
+void LightsSetLength(u32 NumPixels);
+
+/* Sets how many orbs are rendered, up to CONFIG_FEELIGHTS_MAX_ORBS,
+ * returns the count that was applied. The first orbs stay where they are,
+ * only the added ones are placed */
+u32 LightsSetOrbCount(u32 Count);
+
+/* Turns the ambient layer on or off */
+void LightsSetAmbient(bool Enabled);
+
+/* The layers the lights are composed of, from the bottom up, returns how
+ * many there are */
+u32 LightsGetLayers(const fl_layer **Layers);
+
+/* Changes how the layer of that name is blended, Opacity from 0 to 255.
+ * Returns 0 or -EINVAL for an unknown layer or mode */
+int LightsSetLayer(const char *Name, fl_blend_mode Mode, u32 Opacity);
+
+/* Channel values at an intensity of 1 */
+typedef struct {
+   f32 R;
+   f32 G;
+   f32 B;
+} fl_color;
+
+/* What an orb looked like in the last rendered frame */
+typedef struct {
+   f32 P;
+   f32 R;
+   f32 Intensity;
+   fl_color Color;
+} fl_orb_state;
+
+/* Returns how many orbs there are, fills in at most MaxOrbs of them */
+u32 LightsGetOrbs(fl_orb_state *Orbs, u32 MaxOrbs);
+
+f32 LightsGetAmbientIntensity();
+
+/* The ambient color, the flash uses it as well */
+fl_color LightsGetAmbientColor();
+
+/* Moves the orbs and the ambient on by one analysed frame */
+void LightsUpdate(fl_audio_features *Features);
+
+/* Draws the state Blend of the way from the update before the last one to
+ * the last one, 1 draws the last update as it is */
+void LightsRender(pixel *Pixels, u32 NumPixels, f32 Blend);
+
+/* LightsUpdate followed by LightsRender of the new state */
+void LightsUpdateAndRender(pixel *Pixels, u32 NumPixels, fl_audio_features *Features);
+
+/* Slow ambient breathing for when there is nothing to listen to, Seconds is
+ * the time since it started */
+void LightsRenderIdle(pixel *Pixels, u32 NumPixels, f32 Seconds);
 
 #endif /* FL_LIGHTS_H__ */
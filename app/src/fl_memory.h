@@ -0,0 +1,29 @@
+#ifndef FL_MEMORY_H__
+#define FL_MEMORY_H__
+
+#include <zephyr.h>
+#include <devicetree.h>
+#include <linker/devicetree_regions.h>
+#include <linker/section_tags.h>
+
+/* Large buffers that are touched once per frame go to the external SDRAM,
+ * which is not cleared at boot, so everything placed there has to be
+ * initialised by its owner */
+#if defined(CONFIG_FEELIGHTS_SDRAM)
+#define FL_SDRAM Z_GENERIC_SECTION(LINKER_DT_NODE_REGION_NAME(DT_NODELABEL(sdram2)))
+#else
+#define FL_SDRAM
+#endif
+
+/* Data only the CPU touches goes to the core coupled memory, off the bus
+ * matrix the DMA streams use. The DMA can not reach it, so nothing that is
+ * handed to a DMA stream may be placed there, not even on a CCM stack */
+#if defined(CONFIG_FEELIGHTS_CCM)
+#define FL_CCM __ccm_bss_section
+#define FL_CCM_STACK_DEFINE(Symbol, Size) Z_THREAD_STACK_DEFINE_IN(Symbol, Size, __ccm_noinit_section)
+#else
+#define FL_CCM
+#define FL_CCM_STACK_DEFINE(Symbol, Size) K_THREAD_STACK_DEFINE(Symbol, Size)
+#endif
+
+#endif /* FL_MEMORY_H__ */
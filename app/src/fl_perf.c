@@ -0,0 +1,138 @@
+#include <string.h>
+#include "fl_common.h"
+#include "fl_perf.h"
+#include "fl_memory.h"
+#include "zephyr.h"
+
+#if defined(CONFIG_FEELIGHTS_PERF)
+
+internal const char *ProbeNames[PERF_MAX_IDX] = {
+   [PERF_STFT] = "stft",
+   [PERF_NORMALIZE] = "normalize",
+   [PERF_FFT] = "fft",
+   [PERF_BANDS] = "bands",
+   [PERF_BEAT] = "beat",
+   [PERF_RENDER] = "render",
+   [PERF_ENCODE] = "encode",
+   [PERF_PUSH] = "push",
+   [PERF_FRAME] = "frame",
+};
+
+internal fl_perf_stats Probes[PERF_MAX_IDX] FL_CCM;
+
+u32 PerfInit()
+{
+#if defined(CONFIG_CPU_CORTEX_M_HAS_DWT)
+   CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+   DWT->CYCCNT = 0;
+   DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+   PerfReset();
+
+   return 0;
+}
+
+/* The octave is the position of the top bit, the next two bits split it */
+internal inline u32 BucketOf(u32 Cycles)
+{
+   if (Cycles < PERF_BUCKETS_PER_OCTAVE)
+   {
+      return Cycles;
+   }
+
+   u32 Octave = 31 - __builtin_clz(Cycles);
+   u32 Step = (Cycles >> (Octave - 2)) & (PERF_BUCKETS_PER_OCTAVE - 1);
+
+   return (Octave - 1) * PERF_BUCKETS_PER_OCTAVE + Step;
+}
+
+internal inline u32 BucketTop(u32 Bucket)
+{
+   if (Bucket < PERF_BUCKETS_PER_OCTAVE)
+   {
+      return Bucket;
+   }
+
+   u32 Octave = Bucket / PERF_BUCKETS_PER_OCTAVE + 1;
+   u32 Step = Bucket % PERF_BUCKETS_PER_OCTAVE;
+   u64 Top = ((u64)(PERF_BUCKETS_PER_OCTAVE + Step + 1) << (Octave - 2)) - 1;
+
+   return (u32)Minimum(Top, (u64)UINT32_MAX);
+}
+
+void PerfEnd(fl_perf_probe Probe, u32 Start)
+{
+   u32 Cycles = PerfBegin() - Start;
+   fl_perf_stats *Stats = &Probes[Probe];
+
+   Stats->Count++;
+   Stats->LastCycles = Cycles;
+   Stats->TotalCycles += Cycles;
+   Stats->MinCycles = Minimum(Stats->MinCycles, Cycles);
+   Stats->MaxCycles = Maximum(Stats->MaxCycles, Cycles);
+   Stats->Histogram[BucketOf(Cycles)]++;
+   if (Stats->BudgetCycles != 0 && Cycles > Stats->BudgetCycles)
+   {
+      Stats->Overruns++;
+   }
+}
+
+void PerfSetBudget(fl_perf_probe Probe, u32 BudgetUs)
+{
+   Probes[Probe].BudgetCycles = (u32)((u64)BudgetUs * sys_clock_hw_cycles_per_sec() / 1000000);
+}
+
+u32 PerfBudgetCycles(fl_perf_probe Probe)
+{
+   return Probes[Probe].BudgetCycles;
+}
+
+const char *PerfProbeName(fl_perf_probe Probe)
+{
+   return ProbeNames[Probe];
+}
+
+void PerfGetStats(fl_perf_probe Probe, fl_perf_stats *Stats)
+{
+   *Stats = Probes[Probe];
+}
+
+u32 PerfLastCycles(fl_perf_probe Probe)
+{
+   return Probes[Probe].LastCycles;
+}
+
+void PerfReset()
+{
+   for (fl_perf_probe Probe = 0; Probe < PERF_MAX_IDX; ++Probe)
+   {
+      u32 Budget = Probes[Probe].BudgetCycles;
+      memset(&Probes[Probe], 0, sizeof(Probes[Probe]));
+      Probes[Probe].MinCycles = UINT32_MAX;
+      Probes[Probe].BudgetCycles = Budget;
+   }
+}
+
+u32 PerfPercentileCycles(const fl_perf_stats *Stats, u32 PerMille)
+{
+   u32 Target = (u32)(((u64)Stats->Count * PerMille + 999) / 1000);
+   u32 Seen = 0;
+
+   for (u32 Bucket = 0; Bucket < PERF_NUM_BUCKETS; ++Bucket)
+   {
+      Seen += Stats->Histogram[Bucket];
+      if (Seen >= Target && Seen > 0)
+      {
+         return Minimum(BucketTop(Bucket), Stats->MaxCycles);
+      }
+   }
+
+   return Stats->MaxCycles;
+}
+
+u32 PerfCyclesToUs(u32 Cycles)
+{
+   return (u32)((u64)Cycles * 1000000 / sys_clock_hw_cycles_per_sec());
+}
+
+#endif
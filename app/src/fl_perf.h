@@ -0,0 +1,84 @@
+#ifndef FL_PERF_H__
+#define FL_PERF_H__
+
+#include "fl_common.h"
+#include <zephyr.h>
+
+#if defined(CONFIG_FEELIGHTS_PERF) && defined(CONFIG_CPU_CORTEX_M_HAS_DWT)
+#include <soc.h>
+#endif
+
+typedef enum {
+   PERF_STFT,
+   PERF_NORMALIZE,
+   PERF_FFT,
+   PERF_BANDS,
+   PERF_BEAT,
+   PERF_RENDER,
+   PERF_ENCODE,
+   PERF_PUSH,
+   /* From the audio event to the frame handed to the strip */
+   PERF_FRAME,
+   PERF_MAX_IDX,
+} fl_perf_probe;
+
+/* Four buckets per octave of cycles, up to 2^32 */
+#define PERF_BUCKETS_PER_OCTAVE (4)
+#define PERF_NUM_BUCKETS (32 * PERF_BUCKETS_PER_OCTAVE)
+
+typedef struct {
+   u32 Count;
+   u32 LastCycles;
+   u32 MinCycles;
+   u32 MaxCycles;
+   u64 TotalCycles;
+   /* Samples over the budget set for the probe, if any */
+   u32 Overruns;
+   u32 BudgetCycles;
+   u32 Histogram[PERF_NUM_BUCKETS];
+} fl_perf_stats;
+
+#if defined(CONFIG_FEELIGHTS_PERF)
+
+/* Cycle counter of the core, the DWT one where there is one */
+internal inline u32 PerfBegin()
+{
+#if defined(CONFIG_CPU_CORTEX_M_HAS_DWT)
+   return DWT->CYCCNT;
+#else
+   return k_cycle_get_32();
+#endif
+}
+
+u32 PerfInit();
+
+/* Adds one sample to the probe, every probe may only be ended from one thread */
+void PerfEnd(fl_perf_probe Probe, u32 Start);
+
+void PerfSetBudget(fl_perf_probe Probe, u32 BudgetUs);
+
+u32 PerfBudgetCycles(fl_perf_probe Probe);
+
+const char *PerfProbeName(fl_perf_probe Probe);
+
+void PerfGetStats(fl_perf_probe Probe, fl_perf_stats *Stats);
+
+u32 PerfLastCycles(fl_perf_probe Probe);
+
+void PerfReset();
+
+/* Upper bound of the bucket holding the given per mille of the samples */
+u32 PerfPercentileCycles(const fl_perf_stats *Stats, u32 PerMille);
+
+u32 PerfCyclesToUs(u32 Cycles);
+
+#else
+
+internal inline u32 PerfBegin() { return 0; }
+internal inline u32 PerfInit() { return 0; }
+internal inline void PerfEnd(fl_perf_probe Probe, u32 Start) {}
+internal inline void PerfSetBudget(fl_perf_probe Probe, u32 BudgetUs) {}
+
+#endif
+
+#endif // FL_PERF_H__
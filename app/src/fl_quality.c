@@ -0,0 +1,145 @@
+#include <errno.h>
+#include "fl_common.h"
+#include "fl_quality.h"
+#include "zephyr.h"
+
+#if defined(CONFIG_FEELIGHTS_QUALITY)
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(quality);
+
+/* Frames in a row over the risk threshold before stepping down, an overrun
+ * steps down right away */
+#define RISK_FRAMES (4)
+/* A level that overran soon after it was stepped up to waits up to
+ * 2^MAX_BACKOFF times longer before it is tried again */
+#define MAX_BACKOFF (4)
+
+internal const char *LevelNames[QUALITY_MAX_IDX] = {
+   [QUALITY_FULL] = "full",
+   [QUALITY_FEWER_ORBS] = "fewer orbs",
+   [QUALITY_NO_AMBIENT] = "no ambient",
+   [QUALITY_SMALL_FFT] = "small fft",
+   [QUALITY_HALF_RATE] = "half rate",
+};
+
+internal struct
+{
+   fl_quality_stats Stats;
+   volatile fl_quality_level Pinned;
+   u32 RiskCycles;
+   u32 HeadroomCycles;
+   u32 HoldFrames;
+   u32 RiskyFrames;
+   u32 QuietFrames;
+   /* Frames since the last step up, and how often in a row one failed */
+   u32 SinceStepUp;
+   u32 Backoff;
+} Quality;
+
+int QualityInit(u32 BudgetCycles, u32 HoldFrames)
+{
+   if (BudgetCycles == 0)
+   {
+      LOG_ERR("No frame budget to pick the quality level from");
+      return -EINVAL;
+   }
+
+   Quality.Stats.Level = QUALITY_FULL;
+   Quality.Stats.BudgetCycles = BudgetCycles;
+   Quality.Pinned = QUALITY_MAX_IDX;
+   Quality.RiskCycles = (u32)((u64)BudgetCycles * CONFIG_FEELIGHTS_QUALITY_RISK / 100);
+   Quality.HeadroomCycles = (u32)((u64)BudgetCycles * CONFIG_FEELIGHTS_QUALITY_HEADROOM / 100);
+   Quality.HoldFrames = Maximum(HoldFrames, 1);
+   Quality.SinceStepUp = UINT32_MAX;
+
+   return 0;
+}
+
+internal void SetLevel(fl_quality_level Level)
+{
+   LOG_INF("Quality %s -> %s", LevelNames[Quality.Stats.Level], LevelNames[Level]);
+   Quality.Stats.Level = Level;
+   Quality.RiskyFrames = 0;
+   Quality.QuietFrames = 0;
+}
+
+fl_quality_level QualityFrameDone(u32 Cycles)
+{
+   fl_quality_stats *Stats = &Quality.Stats;
+   fl_quality_level Pinned = Quality.Pinned;
+   bool Overrun = Cycles > Stats->BudgetCycles;
+
+   if (Stats->BudgetCycles == 0)
+   {
+      return QUALITY_FULL;
+   }
+
+   Stats->Frames[Stats->Level]++;
+   Stats->Overruns += Overrun ? 1 : 0;
+   Stats->AtRisk += Cycles > Quality.RiskCycles ? 1 : 0;
+   Quality.RiskyFrames = Cycles > Quality.RiskCycles ? Quality.RiskyFrames + 1 : 0;
+   Quality.QuietFrames = Cycles < Quality.HeadroomCycles ? Quality.QuietFrames + 1 : 0;
+   if (Quality.SinceStepUp < UINT32_MAX)
+   {
+      Quality.SinceStepUp++;
+   }
+
+   if (Pinned < QUALITY_MAX_IDX)
+   {
+      if (Stats->Level != Pinned)
+      {
+         SetLevel(Pinned);
+      }
+      return Pinned;
+   }
+
+   if ((Overrun || Quality.RiskyFrames >= RISK_FRAMES) && Stats->Level + 1 < QUALITY_MAX_IDX)
+   {
+      /* The level just stepped up to didn't hold, wait longer next time */
+      if (Quality.SinceStepUp < Quality.HoldFrames)
+      {
+         Quality.Backoff = Minimum(Quality.Backoff + 1, MAX_BACKOFF);
+      }
+      Quality.SinceStepUp = UINT32_MAX;
+      Stats->StepsDown++;
+      SetLevel(Stats->Level + 1);
+   }
+   else if (Stats->Level > QUALITY_FULL && Quality.QuietFrames >= (Quality.HoldFrames << Quality.Backoff))
+   {
+      Quality.SinceStepUp = 0;
+      Stats->StepsUp++;
+      SetLevel(Stats->Level - 1);
+   }
+   else if (Quality.SinceStepUp == Quality.HoldFrames)
+   {
+      /* Held after stepping up */
+      Quality.Backoff = 0;
+   }
+
+   return Stats->Level;
+}
+
+fl_quality_level QualityGetLevel()
+{
+   return Quality.Stats.Level;
+}
+
+void QualityPin(fl_quality_level Level)
+{
+   Quality.Pinned = Minimum(Level, QUALITY_MAX_IDX);
+}
+
+const char *QualityLevelName(fl_quality_level Level)
+{
+   return Level < QUALITY_MAX_IDX ? LevelNames[Level] : "auto";
+}
+
+void QualityGetStats(fl_quality_stats *Stats)
+{
+   *Stats = Quality.Stats;
+   Stats->Pinned = Quality.Pinned;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FL_QUALITY_H__
+#define FL_QUALITY_H__
+
+#include "fl_common.h"
+
+/* Every level keeps the savings of the ones above it */
+typedef enum {
+   QUALITY_FULL,
+   /* Half of the orbs */
+   QUALITY_FEWER_ORBS,
+   /* No ambient pass */
+   QUALITY_NO_AMBIENT,
+   /* Spectrum and bands from a half size FFT */
+   QUALITY_SMALL_FFT,
+   /* Lights rendered and pushed every other hop */
+   QUALITY_HALF_RATE,
+   QUALITY_MAX_IDX,
+} fl_quality_level;
+
+typedef struct {
+   fl_quality_level Level;
+   /* QUALITY_MAX_IDX while the scheduler picks the level */
+   fl_quality_level Pinned;
+   u32 StepsDown;
+   u32 StepsUp;
+   /* Frames over the budget and over the risk threshold */
+   u32 Overruns;
+   u32 AtRisk;
+   u32 BudgetCycles;
+   /* Frames handled at every level */
+   u32 Frames[QUALITY_MAX_IDX];
+} fl_quality_stats;
+
+/* BudgetCycles is the time a frame has, HoldFrames how long frames have to
+ * stay under the headroom threshold before a level is tried again */
+int QualityInit(u32 BudgetCycles, u32 HoldFrames);
+
+/* Feeds the cost of the frame that was just handled, returns the level the
+ * next one should be handled at */
+fl_quality_level QualityFrameDone(u32 Cycles);
+
+fl_quality_level QualityGetLevel();
+
+/* Keeps the level fixed, QUALITY_MAX_IDX hands it back to the scheduler */
+void QualityPin(fl_quality_level Level);
+
+const char *QualityLevelName(fl_quality_level Level);
+
+void QualityGetStats(fl_quality_stats *Stats);
+
+#endif /* FL_QUALITY_H__ */
@@ -1,5 +1,10 @@
 #include "fl_common.h"
 #include "fl_strip.h"
+#include "fl_strip_backend.h"
+#include "fl_memory.h"
+#include "fl_perf.h"
+#include <errno.h>
+#include <string.h>
 #include "zephyr.h"
 #include "device.h"
 
@@ -8,26 +13,77 @@
 LOG_MODULE_REGISTER(strip);
 
 /* LED STRIP */
-#define STRIP_NODE		DT_ALIAS(led_strip)
-#define STRIP_NUM_PIXELS	DT_PROP(DT_ALIAS(led_strip), chain_length)
 #define STRIP_STACKSIZE 1024
 #define STRIP_PRIORITY 7
 #define STRIP_START_DELAY_MS 5
 
-internal const struct device *StripDevice = DEVICE_DT_GET(STRIP_NODE);
+/* The backends only hand static buffers to the DMA, so the stack can be in CCM */
+FL_CCM_STACK_DEFINE(PushThreadStack, STRIP_STACKSIZE);
+internal struct k_thread PushThreadData;
 
-internal pixel PixelArena[STRIP_NUM_PIXELS * 2];
+#define STRIP_NUM_BUFFERS 3
+#define STRIP_NO_BUFFER (-1)
+
+/* One buffer being rendered, one waiting to be pushed and one on the wire,
+ * so the renderer never has to wait for the strip */
+internal pixel PixelArena[STRIP_MAX_PIXELS * STRIP_NUM_BUFFERS] FL_SDRAM;
 
 internal struct
 {
-   pixel *PixelsStart;
-   u32 NumOfPixels;
+   struct k_spinlock Lock;
+   /* Buffer indices, guarded by Lock */
+   i32 Pending;
+   i32 Pushing;
+   u32 PendingNumOfPixels;
+   u32 Length;
    struct k_poll_signal PushSignal;
    struct k_poll_event PushEvent;
-   
+   struct k_poll_signal DoneSignal;
+   fl_strip_stats Stats;
 } PushJob;
 
-internal void PushThread(void)
+internal inline pixel *BufferAt(i32 Index)
+{
+   return PixelArena + Index * STRIP_MAX_PIXELS;
+}
+
+internal inline i32 BufferIndex(pixel *Pixels)
+{
+   return (i32)((Pixels - PixelArena) / STRIP_MAX_PIXELS);
+}
+
+internal void PushPending(void)
+{
+   k_spinlock_key_t Key = k_spin_lock(&PushJob.Lock);
+   i32 Index = PushJob.Pending;
+   u32 NumOfPixels = Minimum(PushJob.PendingNumOfPixels, PushJob.Length);
+   PushJob.Pushing = Index;
+   PushJob.Pending = STRIP_NO_BUFFER;
+   k_spin_unlock(&PushJob.Lock, Key);
+
+   if (Index == STRIP_NO_BUFFER)
+   {
+      return;
+   }
+
+   u32 Start = k_cycle_get_32();
+   u32 PerfStart = PerfBegin();
+   u32 Error = StripBackendPush(BufferAt(Index), NumOfPixels);
+   PerfEnd(PERF_PUSH, PerfStart);
+   u32 PushUs = k_cyc_to_us_floor32(k_cycle_get_32() - Start);
+
+   Key = k_spin_lock(&PushJob.Lock);
+   PushJob.Pushing = STRIP_NO_BUFFER;
+   PushJob.Stats.FramesPushed++;
+   PushJob.Stats.Errors += Error ? 1 : 0;
+   PushJob.Stats.LastPushUs = PushUs;
+   PushJob.Stats.MaxPushUs = Maximum(PushJob.Stats.MaxPushUs, PushUs);
+   k_spin_unlock(&PushJob.Lock, Key);
+
+   k_poll_signal_raise(&PushJob.DoneSignal, 0);
+}
+
+internal void PushThread(void *P1, void *P2, void *P3)
 {
    int WaitResult;
 
@@ -42,15 +98,7 @@ internal void PushThread(void)
                PushJob.PushEvent.signal->signaled = 0;
                PushJob.PushEvent.state = K_POLL_STATE_NOT_READY;
 
-               if (PushJob.NumOfPixels > STRIP_NUM_PIXELS)
-               {
-                  PushJob.NumOfPixels = STRIP_NUM_PIXELS;
-               }
-               int rc = led_strip_update_rgb(StripDevice, &PushJob.PixelsStart->Color, PushJob.NumOfPixels);
-
-               if (rc) {
-                  LOG_ERR("couldn't update strip: %d", rc);
-               }
+               PushPending();
             }
             break;
          default:
@@ -60,10 +108,13 @@ internal void PushThread(void)
    }
 }
 
-K_THREAD_DEFINE(PushThreadId, STRIP_STACKSIZE, PushThread, NULL, NULL, NULL, STRIP_PRIORITY, 0, STRIP_START_DELAY_MS);
-
-u32 StripInit()
+int StripInit()
 {
+   PushJob.Pending = STRIP_NO_BUFFER;
+   PushJob.Pushing = STRIP_NO_BUFFER;
+   PushJob.Length = STRIP_NUM_PIXELS;
+   memset(PixelArena, 0, sizeof(PixelArena));
+
    k_poll_event_init(&PushJob.PushEvent,
          K_POLL_TYPE_SIGNAL,
          K_POLL_MODE_NOTIFY_ONLY,
@@ -71,29 +122,90 @@ u32 StripInit()
 
    /* TODO(kleindan) errors?! */
    k_poll_signal_init(&PushJob.PushSignal);
+   k_poll_signal_init(&PushJob.DoneSignal);
 
-	if (device_is_ready(StripDevice)) {
-		LOG_INF("Found LED strip device %s", StripDevice->name);
-	} else {
-		LOG_ERR("LED strip device %s is not ready", StripDevice->name);
-      /* TODO(kleindan) define errors */
-		return 234;
-	}
+   int Result = StripBackendInit();
+   PushJob.Length = Minimum(PushJob.Length, StripBackendMaxPixels());
 
-   return 0;
+   k_thread_create(&PushThreadData, PushThreadStack, K_THREAD_STACK_SIZEOF(PushThreadStack),
+         PushThread, NULL, NULL, NULL, STRIP_PRIORITY, 0, K_MSEC(STRIP_START_DELAY_MS));
+   k_thread_name_set(&PushThreadData, "strip_push");
+
+   return Result;
+}
+
+u32 StripSetLength(u32 NumOfPixels)
+{
+   NumOfPixels = Minimum(NumOfPixels, Minimum(STRIP_MAX_PIXELS, StripBackendMaxPixels()));
+
+   k_spinlock_key_t Key = k_spin_lock(&PushJob.Lock);
+   PushJob.Length = NumOfPixels;
+   k_spin_unlock(&PushJob.Lock, Key);
+
+   return NumOfPixels;
+}
+
+u32 StripGetLength()
+{
+   return PushJob.Length;
+}
+
+u32 StripFrameUs()
+{
+   return (u32)((u64)PushJob.Length * STRIP_PIXEL_WIRE_NS / 1000) + STRIP_LATCH_US;
 }
 
 
 
 u32 StripOutput(pixel *Pixels, u32 NumOfPixels)
 {
-   PushJob.PixelsStart = Pixels;
-   PushJob.NumOfPixels = NumOfPixels;
+   k_spinlock_key_t Key = k_spin_lock(&PushJob.Lock);
+   if (PushJob.Pending != STRIP_NO_BUFFER)
+   {
+      /* The strip did not get to the previous frame, the newest one wins */
+      PushJob.Stats.FramesSkipped++;
+   }
+   PushJob.Pending = BufferIndex(Pixels);
+   PushJob.PendingNumOfPixels = NumOfPixels;
+   PushJob.Stats.FramesRendered++;
+   k_spin_unlock(&PushJob.Lock, Key);
+
    k_poll_signal_raise(&PushJob.PushSignal, 0);
 
    return 0;
 }
 
+int StripWaitForPush(u32 TimeoutMs)
+{
+   struct k_poll_event DoneEvent = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+         K_POLL_MODE_NOTIFY_ONLY, &PushJob.DoneSignal);
+
+   while (1)
+   {
+      k_spinlock_key_t Key = k_spin_lock(&PushJob.Lock);
+      bool Idle = PushJob.Pending == STRIP_NO_BUFFER && PushJob.Pushing == STRIP_NO_BUFFER;
+      k_poll_signal_reset(&PushJob.DoneSignal);
+      k_spin_unlock(&PushJob.Lock, Key);
+
+      if (Idle)
+      {
+         return 0;
+      }
+      if (k_poll(&DoneEvent, 1, K_MSEC(TimeoutMs)) != 0)
+      {
+         return -ETIMEDOUT;
+      }
+      DoneEvent.state = K_POLL_STATE_NOT_READY;
+   }
+}
+
+void StripGetStats(fl_strip_stats *Stats)
+{
+   k_spinlock_key_t Key = k_spin_lock(&PushJob.Lock);
+   *Stats = PushJob.Stats;
+   k_spin_unlock(&PushJob.Lock, Key);
+}
+
 pixel* StripGetBuffer()
 {
    return PixelArena;
@@ -101,6 +213,19 @@ pixel* StripGetBuffer()
 
 pixel* StripSwapBuffer(pixel *PixelBuffer)
 {
-   return (PixelBuffer == PixelArena) ? PixelArena + STRIP_NUM_PIXELS : PixelArena;
-}
+   i32 Current = BufferIndex(PixelBuffer);
+   i32 Next = Current;
 
+   k_spinlock_key_t Key = k_spin_lock(&PushJob.Lock);
+   for (i32 I = 0; I < STRIP_NUM_BUFFERS; ++I)
+   {
+      if (I != Current && I != PushJob.Pending && I != PushJob.Pushing)
+      {
+         Next = I;
+         break;
+      }
+   }
+   k_spin_unlock(&PushJob.Lock, Key);
+
+   return BufferAt(Next);
+}
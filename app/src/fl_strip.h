@@ -2,19 +2,67 @@
 #define FL_STRIP_H__
 
 #include "fl_common.h"
+#include <devicetree.h>
 #include <drivers/led_strip.h>
 
+/* Pixels in a frame, with parallel strips it holds them one after another */
+#if defined(CONFIG_FEELIGHTS_STRIP_PARALLEL)
+#define STRIP_PARALLEL_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(feelights_ws2812_parallel)
+#define STRIP_ADD_CHAIN_LENGTH(Node, Prop, Idx) DT_PROP_BY_IDX(Node, Prop, Idx) +
+#define STRIP_NUM_PIXELS (DT_FOREACH_PROP_ELEM(STRIP_PARALLEL_NODE, chain_lengths, STRIP_ADD_CHAIN_LENGTH) 0)
+#else
+#define STRIP_NUM_PIXELS DT_PROP(DT_ALIAS(led_strip), chain_length)
+#endif
+
+/* Room in every frame buffer, the strip length can be changed up to this at
+ * runtime as far as the backend allows */
+#define STRIP_MAX_PIXELS Maximum(CONFIG_FEELIGHTS_MAX_PIXELS, STRIP_NUM_PIXELS)
+
+/* A WS2812 bit takes 1.25 us, 24 of them per pixel, and the strip latches
+ * once the line stayed low for over 280 us */
+#define STRIP_PIXEL_WIRE_NS (24 * 1250)
+#define STRIP_LATCH_US (300)
+
 typedef union {
    u32 Dword;
    struct led_rgb Color;
 } pixel;
 
-u32 StripInit();
+typedef struct {
+   u32 FramesRendered;
+   u32 FramesPushed;
+   /* Frames replaced by a newer one before the strip got to them */
+   u32 FramesSkipped;
+   u32 Errors;
+   u32 LastPushUs;
+   u32 MaxPushUs;
+} fl_strip_stats;
 
+/* Returns 0 or the negative errno of the backend */
+int StripInit();
+
+/* Queues the frame for the push thread, a frame still waiting is dropped */
 u32 StripOutput(pixel *Pixels, u32 NumOfPixels);
 
+/* Blocks until every queued frame is out on the wire, -ETIMEDOUT if that
+ * takes longer than TimeoutMs */
+int StripWaitForPush(u32 TimeoutMs);
+
+void StripGetStats(fl_strip_stats *Stats);
+
+/* Starts out at STRIP_NUM_PIXELS, returns the length actually set */
+u32 StripSetLength(u32 NumOfPixels);
+
+u32 StripGetLength();
+
+/* Time a frame of the current length takes on the wire, frames queued
+ * faster than this are dropped. The parallel backend sends its chains side
+ * by side and is quicker */
+u32 StripFrameUs();
+
 pixel* StripGetBuffer();
 
+/* Returns a buffer that is neither queued nor being pushed, its contents are stale */
 pixel* StripSwapBuffer(pixel *PixelBuffer);
 
 #endif /* FL_STRIP_H__ */
@@ -0,0 +1,17 @@
+#ifndef FL_STRIP_BACKEND_H__
+#define FL_STRIP_BACKEND_H__
+
+#include "fl_common.h"
+#include "fl_strip.h"
+
+/* Implemented by exactly one of the fl_strip_*.c files, picked by
+ * CONFIG_FEELIGHTS_STRIP_BACKEND. Returns 0 or a negative errno */
+int StripBackendInit();
+
+/* Longest strip the backend can push */
+u32 StripBackendMaxPixels();
+
+/* Blocks until the pixels are out on the wire */
+u32 StripBackendPush(pixel *Pixels, u32 NumOfPixels);
+
+#endif /* FL_STRIP_BACKEND_H__ */
@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <stdio.h>
+#include "fl_common.h"
+#include "fl_strip_backend.h"
+#include "fl_perf.h"
+#include "zephyr.h"
+
+#if defined(CONFIG_FEELIGHTS_STRIP_FILE)
+
+/* native_posix command line */
+#include "soc.h"
+#include "cmdline.h"
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(strip_file);
+
+/* Every frame is a little endian header followed by the pixels as r, g, b */
+typedef struct {
+   u32 UptimeUs;
+   u32 NumPixels;
+} fl_strip_file_frame;
+
+internal char *StripPath = CONFIG_FEELIGHTS_STRIP_FILE_PATH;
+
+internal struct args_struct_t StripOptions[] = {
+   { .option = "strip-out", .name = "path", .type = 's', .dest = (void *)&StripPath,
+     .descript = "File every pushed strip frame is appended to" },
+   ARG_TABLE_ENDMARKER
+};
+
+internal void AddStripOptions()
+{
+   native_add_command_line_opts(StripOptions);
+}
+NATIVE_TASK(AddStripOptions, PRE_BOOT_1, 10);
+
+internal FILE *StripFile;
+internal u8 FrameBytes[sizeof(fl_strip_file_frame) + STRIP_MAX_PIXELS * 3];
+
+internal inline u8 *WriteLe(u8 *Out, u32 Value)
+{
+   Out[0] = (u8)Value;
+   Out[1] = (u8)(Value >> 8);
+   Out[2] = (u8)(Value >> 16);
+   Out[3] = (u8)(Value >> 24);
+
+   return Out + 4;
+}
+
+int StripBackendInit()
+{
+   StripFile = fopen(StripPath, "wb");
+   if (StripFile == NULL)
+   {
+      LOG_ERR("Can't create strip file %s", StripPath);
+      return -errno;
+   }
+
+   LOG_INF("Writing frames of up to %u pixels to %s", STRIP_MAX_PIXELS, StripPath);
+
+   return 0;
+}
+
+u32 StripBackendMaxPixels()
+{
+   return STRIP_MAX_PIXELS;
+}
+
+u32 StripBackendPush(pixel *Pixels, u32 NumOfPixels)
+{
+   u32 Start = PerfBegin();
+   u8 *Out = FrameBytes;
+
+   Out = WriteLe(Out, (u32)k_ticks_to_us_floor64(k_uptime_ticks()));
+   Out = WriteLe(Out, NumOfPixels);
+   for (u32 I = 0; I < NumOfPixels; ++I)
+   {
+      *Out++ = Pixels[I].Color.r;
+      *Out++ = Pixels[I].Color.g;
+      *Out++ = Pixels[I].Color.b;
+   }
+   PerfEnd(PERF_ENCODE, Start);
+
+   if (fwrite(FrameBytes, 1, Out - FrameBytes, StripFile) != (size_t)(Out - FrameBytes))
+   {
+      LOG_ERR("couldn't write strip frame to %s", StripPath);
+      return 1;
+   }
+
+   return 0;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#include <errno.h>
+#include "fl_common.h"
+#include "fl_strip_backend.h"
+#include "zephyr.h"
+#include "device.h"
+
+#if defined(CONFIG_FEELIGHTS_STRIP_LED_STRIP)
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(strip_ledstrip);
+
+#define STRIP_NODE		DT_ALIAS(led_strip)
+
+internal const struct device *StripDevice = DEVICE_DT_GET(STRIP_NODE);
+
+int StripBackendInit()
+{
+	if (device_is_ready(StripDevice)) {
+		LOG_INF("Found LED strip device %s", StripDevice->name);
+	} else {
+		LOG_ERR("LED strip device %s is not ready", StripDevice->name);
+		return -ENODEV;
+	}
+
+   return 0;
+}
+
+/* The driver encodes into a buffer sized for the chain in the devicetree */
+u32 StripBackendMaxPixels()
+{
+   return DT_PROP(STRIP_NODE, chain_length);
+}
+
+u32 StripBackendPush(pixel *Pixels, u32 NumOfPixels)
+{
+   int rc = led_strip_update_rgb(StripDevice, &Pixels->Color, NumOfPixels);
+
+   if (rc) {
+      LOG_ERR("couldn't update strip: %d", rc);
+      return 1;
+   }
+
+   return 0;
+}
+
+#endif
@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <string.h>
+#include "fl_common.h"
+#include "fl_strip_backend.h"
+#include "fl_perf.h"
+#include "zephyr.h"
+#include "device.h"
+#include <drivers/dma.h>
+#include <drivers/gpio.h>
+
+#if defined(CONFIG_FEELIGHTS_STRIP_PARALLEL)
+
+#include <drivers/clock_control.h>
+#include <drivers/clock_control/stm32_clock_control.h>
+#include "stm32f4xx_ll_bus.h"
+#include "stm32f4xx_ll_rcc.h"
+#include "stm32f4xx_ll_tim.h"
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(strip_parallel);
+
+#define PORT_NODE DT_PHANDLE(STRIP_PARALLEL_NODE, gpio_port)
+#define STRIP_NUM_STRIPS DT_PROP_LEN(STRIP_PARALLEL_NODE, chain_lengths)
+#define STRIP_LANE DT_PROP(STRIP_PARALLEL_NODE, lane)
+
+/* The size of a union with one member per strip is the longest chain */
+#define STRIP_LENGTH_MEMBER(Node, Prop, Idx) u8 Strip##Idx[DT_PROP_BY_IDX(Node, Prop, Idx)];
+union longest_strip {
+   DT_FOREACH_PROP_ELEM(STRIP_PARALLEL_NODE, chain_lengths, STRIP_LENGTH_MEMBER)
+};
+#define STRIP_MAX_LENGTH (sizeof(union longest_strip))
+
+#define STRIP_CHAIN_LENGTH(Node, Prop, Idx) DT_PROP_BY_IDX(Node, Prop, Idx),
+
+#define BITS_PER_PIXEL (24)
+#define WAVE_SIZE (STRIP_MAX_LENGTH * BITS_PER_PIXEL)
+
+/* BSRR sets pins with its low half word and resets them with the high one */
+#define BSRR_ADDRESS (DT_REG_ADDR(PORT_NODE) + 0x18)
+#define BSRR_SET_ADDRESS (BSRR_ADDRESS + STRIP_LANE)
+#define BSRR_RESET_ADDRESS (BSRR_ADDRESS + 2 + STRIP_LANE)
+
+/* WS2812 bit of 1.25 us, 0 is high for 0.4 us and 1 for 0.8 us */
+#define BIT_FREQUENCY (800000)
+#define T0H_NS (400)
+#define T1H_NS (800)
+#define LATCH_US (300)
+#define PUSH_TIMEOUT_MS (100)
+
+/* DMA2 request mapping for TIM1, each of these streams is requested by one
+ * event only. Stream 6 channel 0 would fire on CC1 as well */
+#define DMA_STREAM_SET 5
+#define DMA_SLOT_SET 6
+#define DMA_STREAM_DATA 3
+#define DMA_SLOT_DATA 6
+#define DMA_STREAM_RESET 2
+#define DMA_SLOT_RESET 6
+
+internal const struct device *DmaDevice = DEVICE_DT_GET(DT_NODELABEL(dma2));
+internal const struct device *PortDevice = DEVICE_DT_GET(PORT_NODE);
+
+internal const u32 ChainLengths[STRIP_NUM_STRIPS] = {
+   DT_FOREACH_PROP_ELEM(STRIP_PARALLEL_NODE, chain_lengths, STRIP_CHAIN_LENGTH)
+};
+
+/* One byte per bit time, bit N resets the line of strip N when it sends a 0 */
+internal u8 Wave[WAVE_SIZE];
+internal const u8 AllLines = (u8)((1u << STRIP_NUM_STRIPS) - 1);
+internal struct k_sem PushDone;
+
+/* Byte J of the result holds bit J of every input byte, input byte N in bit N */
+internal inline u64 Transpose8x8(u64 X)
+{
+   u64 T;
+
+   T = (X ^ (X >> 7)) & 0x00AA00AA00AA00AAULL;
+   X = X ^ T ^ (T << 7);
+   T = (X ^ (X >> 14)) & 0x0000CCCC0000CCCCULL;
+   X = X ^ T ^ (T << 14);
+   T = (X ^ (X >> 28)) & 0x00000000F0F0F0F0ULL;
+   X = X ^ T ^ (T << 28);
+
+   return X;
+}
+
+internal inline u8 *EncodeColumn(u8 *Out, u64 Column)
+{
+   u64 Bits = Transpose8x8(Column);
+
+   /* Most significant bit goes out first */
+   for (i32 Bit = 7; Bit >= 0; --Bit)
+   {
+      *Out++ = ~(u8)(Bits >> (8 * Bit)) & AllLines;
+   }
+
+   return Out;
+}
+
+internal void Encode(pixel *Pixels, u32 NumOfPixels)
+{
+   pixel *Strips[STRIP_NUM_STRIPS];
+   u32 Lengths[STRIP_NUM_STRIPS];
+   u8 *Out = Wave;
+
+   for (u32 S = 0, Offset = 0; S < STRIP_NUM_STRIPS; ++S)
+   {
+      Strips[S] = Pixels + Offset;
+      Lengths[S] = Offset < NumOfPixels ? Minimum(ChainLengths[S], NumOfPixels - Offset) : 0;
+      Offset += ChainLengths[S];
+   }
+
+   for (u32 I = 0; I < STRIP_MAX_LENGTH; ++I)
+   {
+      u64 G = 0, R = 0, B = 0;
+
+      for (u32 S = 0; S < STRIP_NUM_STRIPS; ++S)
+      {
+         if (I < Lengths[S])
+         {
+            G |= (u64)Strips[S][I].Color.g << (8 * S);
+            R |= (u64)Strips[S][I].Color.r << (8 * S);
+            B |= (u64)Strips[S][I].Color.b << (8 * S);
+         }
+      }
+
+      Out = EncodeColumn(Out, G);
+      Out = EncodeColumn(Out, R);
+      Out = EncodeColumn(Out, B);
+   }
+}
+
+internal void DmaCallback(const struct device *Dev, void *UserData, uint32_t Channel, int Status)
+{
+   LL_TIM_DisableCounter(TIM1);
+
+   if (Status < 0)
+   {
+      LOG_ERR("Dma transfer error %d", Status);
+   }
+
+   k_sem_give(&PushDone);
+}
+
+/* APB2 timers run at twice the bus clock unless the bus is not divided */
+internal int GetTimerClock(u32 *TimerClock)
+{
+   const struct device *Clock = DEVICE_DT_GET(STM32_CLOCK_CONTROL_NODE);
+   struct stm32_pclken Subsystem = {
+      .bus = STM32_CLOCK_BUS_APB2,
+      .enr = LL_APB2_GRP1_PERIPH_TIM1,
+   };
+   u32 BusClock;
+
+   int ReturnCode = clock_control_get_rate(Clock, (clock_control_subsys_t)&Subsystem, &BusClock);
+   if (ReturnCode != 0)
+   {
+      LOG_ERR("Could not get the APB2 clock %d", ReturnCode);
+      return ReturnCode;
+   }
+
+   *TimerClock = LL_RCC_GetAPB2Prescaler() == LL_RCC_APB2_DIV_1 ? BusClock : 2 * BusClock;
+
+   return 0;
+}
+
+internal int StreamConfig(u32 Stream, u32 Slot, const u8 *Source, bool Increment, u32 Destination, bool Callback)
+{
+   struct dma_block_config BlockConfig = {
+      .source_address = (u32)Source,
+      .dest_address = Destination,
+      .block_size = WAVE_SIZE,
+      .source_addr_adj = Increment ? DMA_ADDR_ADJ_INCREMENT : DMA_ADDR_ADJ_NO_CHANGE,
+      .dest_addr_adj = DMA_ADDR_ADJ_NO_CHANGE,
+   };
+   struct dma_config DevConfig = {
+      .dma_slot = Slot,
+      .channel_direction = MEMORY_TO_PERIPHERAL,
+      .complete_callback_en = 1,
+      .error_callback_en = 1,
+      /* Any jitter shows up on the wire */
+      .channel_priority = 0x3,
+      .source_data_size = 1,
+      .dest_data_size = 1,
+      .source_burst_length = 1,
+      .dest_burst_length = 1,
+      .block_count = 1,
+      .dma_callback = Callback ? DmaCallback : NULL,
+      .head_block = &BlockConfig,
+   };
+
+   int ReturnCode = dma_config(DmaDevice, Stream, &DevConfig);
+   if (ReturnCode != 0)
+   {
+      LOG_ERR("Dma config of stream %u failed %d", Stream, ReturnCode);
+      return ReturnCode;
+   }
+
+   return 0;
+}
+
+int StripBackendInit()
+{
+   u32 TimerClock;
+
+   if (!device_is_ready(DmaDevice) || !device_is_ready(PortDevice))
+   {
+      LOG_ERR("DMA or GPIO port for the parallel strips is not ready");
+      return -ENODEV;
+   }
+
+   int ReturnCode = GetTimerClock(&TimerClock);
+   if (ReturnCode != 0)
+   {
+      return ReturnCode;
+   }
+   u32 Period = TimerClock / BIT_FREQUENCY;
+
+   if (WAVE_SIZE > 0xFFFF)
+   {
+      LOG_ERR("Strips of %u pixels are too long for one DMA transfer", STRIP_MAX_LENGTH);
+      return -EINVAL;
+   }
+
+   for (u32 S = 0; S < STRIP_NUM_STRIPS; ++S)
+   {
+      gpio_pin_configure(PortDevice, 8 * STRIP_LANE + S, GPIO_OUTPUT_LOW);
+   }
+
+   k_sem_init(&PushDone, 0, 1);
+
+   LL_APB2_GRP1_EnableClock(LL_APB2_GRP1_PERIPH_TIM1);
+   LL_TIM_SetPrescaler(TIM1, 0);
+   LL_TIM_SetAutoReload(TIM1, Period - 1);
+   LL_TIM_OC_SetCompareCH1(TIM1, (u32)((u64)TimerClock * T0H_NS / 1000000000));
+   LL_TIM_OC_SetCompareCH2(TIM1, (u32)((u64)TimerClock * T1H_NS / 1000000000));
+   LL_TIM_EnableDMAReq_UPDATE(TIM1);
+   LL_TIM_EnableDMAReq_CC1(TIM1);
+   LL_TIM_EnableDMAReq_CC2(TIM1);
+
+   LOG_INF("Driving %u strips of up to %u pixels in parallel", STRIP_NUM_STRIPS, STRIP_MAX_LENGTH);
+
+   return 0;
+}
+
+/* The frame is split along the chain lengths, the wave buffer is sized for them */
+u32 StripBackendMaxPixels()
+{
+   return STRIP_NUM_PIXELS;
+}
+
+u32 StripBackendPush(pixel *Pixels, u32 NumOfPixels)
+{
+   u32 Error = 0;
+
+   u32 Start = PerfBegin();
+   Encode(Pixels, NumOfPixels);
+   PerfEnd(PERF_ENCODE, Start);
+
+   if (StreamConfig(DMA_STREAM_SET, DMA_SLOT_SET, &AllLines, false, BSRR_SET_ADDRESS, false) != 0 ||
+       StreamConfig(DMA_STREAM_DATA, DMA_SLOT_DATA, Wave, true, BSRR_RESET_ADDRESS, false) != 0 ||
+       StreamConfig(DMA_STREAM_RESET, DMA_SLOT_RESET, &AllLines, false, BSRR_RESET_ADDRESS, true) != 0)
+   {
+      return 1;
+   }
+
+   k_sem_reset(&PushDone);
+   dma_start(DmaDevice, DMA_STREAM_SET);
+   dma_start(DmaDevice, DMA_STREAM_DATA);
+   dma_start(DmaDevice, DMA_STREAM_RESET);
+
+   /* Start right before an update so every bit begins with the set request */
+   LL_TIM_SetCounter(TIM1, LL_TIM_GetAutoReload(TIM1));
+   LL_TIM_EnableCounter(TIM1);
+
+   if (k_sem_take(&PushDone, K_MSEC(PUSH_TIMEOUT_MS)) != 0)
+   {
+      LOG_ERR("Parallel push timed out");
+      LL_TIM_DisableCounter(TIM1);
+      Error = 1;
+   }
+
+   dma_stop(DmaDevice, DMA_STREAM_SET);
+   dma_stop(DmaDevice, DMA_STREAM_DATA);
+   dma_stop(DmaDevice, DMA_STREAM_RESET);
+
+   k_usleep(LATCH_US);
+
+   return Error;
+}
+
+#endif
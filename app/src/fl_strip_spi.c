@@ -0,0 +1,337 @@
+#include <errno.h>
+#include <string.h>
+#include "fl_common.h"
+#include "fl_strip_backend.h"
+#include "fl_strip_spi.h"
+#include "fl_memory.h"
+#include "fl_perf.h"
+#include "zephyr.h"
+#include "device.h"
+#include <drivers/spi.h>
+#include <drivers/dma.h>
+
+#if defined(CONFIG_FEELIGHTS_STRIP_SPI)
+
+#define LOG_LEVEL 4
+#include <logging/log.h>
+LOG_MODULE_REGISTER(strip_spi);
+
+/* The strip node only describes the chain, the SPI bus is driven directly */
+#define STRIP_NODE		DT_ALIAS(led_strip)
+
+/* The strip latches after the line is held low for over 280 us */
+#define STRIP_RESET_BYTES (96)
+
+#if defined(CONFIG_FEELIGHTS_STRIP_SPI_STREAMING)
+
+#include <drivers/clock_control.h>
+#include <drivers/clock_control/stm32_clock_control.h>
+#include "stm32f4xx_ll_dma.h"
+#include "stm32f4xx_ll_spi.h"
+
+#define STRIP_BUS DT_BUS(STRIP_NODE)
+#define STRIP_SPI ((SPI_TypeDef *)DT_REG_ADDR(STRIP_BUS))
+#define DMA_NODE DT_DMAS_CTLR_BY_NAME(STRIP_BUS, tx)
+#define DMA_CONTROLLER ((DMA_TypeDef *)DT_REG_ADDR(DMA_NODE))
+#define DMA_CHANNEL DT_DMAS_CELL_BY_NAME(STRIP_BUS, tx, channel)
+#define DMA_SLOT DT_DMAS_CELL_BY_NAME(STRIP_BUS, tx, slot)
+
+/* The bus clock is divided by a power of two from 2 to 256, the closest
+ * rate has to be within this of STRIP_SPI_FREQUENCY */
+#define STRIP_SPI_TOLERANCE_PERCENT (5)
+#define SPI_MAX_PRESCALER_SHIFT (7)
+
+/* Each half of the ring holds this many encoded pixels, it is refilled while
+ * the DMA sends the other half (219 us at this clock) */
+#define STREAM_CHUNK_PIXELS (8)
+#define STREAM_HALF_BYTES (STREAM_CHUNK_PIXELS * STRIP_BYTES_PER_PIXEL)
+/* All zero halves sent after the pixels, enough to cover STRIP_RESET_BYTES */
+#define STREAM_LATCH_HALVES ((STRIP_RESET_BYTES + STREAM_HALF_BYTES - 1) / STREAM_HALF_BYTES)
+#define PUSH_TIMEOUT_MS (100)
+
+internal const struct device *DmaDevice = DEVICE_DT_GET(DMA_NODE);
+internal const struct device *ClockDevice = DEVICE_DT_GET(STM32_CLOCK_CONTROL_NODE);
+internal struct stm32_pclken SpiClock = {
+   .bus = DT_CLOCKS_CELL(STRIP_BUS, bus),
+   .enr = DT_CLOCKS_CELL(STRIP_BUS, bits),
+};
+
+internal u8 Ring[2 * STREAM_HALF_BYTES];
+
+internal struct
+{
+   pixel *Pixels;
+   u32 NumOfPixels;
+   u32 Next;
+   /* Set for halves that only hold the latch gap */
+   bool Latch[2];
+   u32 LatchSent;
+   struct k_sem Done;
+} Stream;
+
+/* Encodes the next chunk into one half, returns true if there was nothing
+ * left to encode */
+internal bool StreamFill(u32 Half)
+{
+   u32 Count = EncodeChunk(Ring + Half * STREAM_HALF_BYTES, Stream.Pixels + Stream.Next,
+                           Stream.NumOfPixels - Stream.Next, STREAM_CHUNK_PIXELS);
+   Stream.Next += Count;
+
+   return Count == 0;
+}
+
+internal void DmaCallback(const struct device *Dev, void *UserData, uint32_t Channel, int Status)
+{
+   struct dma_status DmaStatus;
+   u32 Half = 1;
+
+   if (Status < 0)
+   {
+      LOG_ERR("Dma transfer error %d", Status);
+      dma_stop(Dev, Channel);
+      k_sem_give(&Stream.Done);
+      return;
+   }
+
+   /* Same as the audio capture, the counter is in the lower half while the
+    * DMA is sending the second half, so the first one is free */
+   if ((dma_get_status(Dev, Channel, &DmaStatus) == 0) &&
+       (DmaStatus.pending_length <= STREAM_HALF_BYTES))
+   {
+      Half = 0;
+   }
+
+   if (Stream.Latch[Half] && ++Stream.LatchSent >= STREAM_LATCH_HALVES)
+   {
+      dma_stop(Dev, Channel);
+      k_sem_give(&Stream.Done);
+      return;
+   }
+
+   Stream.Latch[Half] = StreamFill(Half);
+}
+
+internal int StreamConfig()
+{
+   struct dma_block_config BlockConfig = {
+      .source_address = (u32)Ring,
+      .dest_address = LL_SPI_DMA_GetRegAddr(STRIP_SPI),
+      .block_size = sizeof(Ring),
+      .source_addr_adj = DMA_ADDR_ADJ_INCREMENT,
+      .dest_addr_adj = DMA_ADDR_ADJ_NO_CHANGE,
+      .source_reload_en = 1,
+      .dest_reload_en = 1,
+   };
+   struct dma_config DevConfig = {
+      .dma_slot = DMA_SLOT,
+      .channel_direction = MEMORY_TO_PERIPHERAL,
+      .complete_callback_en = 1,
+      .error_callback_en = 1,
+      .channel_priority = 0x3,
+      .source_data_size = 1,
+      .dest_data_size = 1,
+      .source_burst_length = 1,
+      .dest_burst_length = 1,
+      .block_count = 1,
+      .dma_callback = DmaCallback,
+      .head_block = &BlockConfig,
+   };
+
+   int ReturnCode = dma_config(DmaDevice, DMA_CHANNEL, &DevConfig);
+   if (ReturnCode != 0)
+   {
+      LOG_ERR("Dma config failed %d", ReturnCode);
+      return ReturnCode;
+   }
+
+   /* Refill on both halves of the ring */
+   LL_DMA_EnableIT_HT(DMA_CONTROLLER, DMA_CHANNEL);
+
+   return 0;
+}
+
+/* The prescaler that gets closest to STRIP_SPI_FREQUENCY from the bus clock */
+internal int SpiPrescaler(u32 *Prescaler)
+{
+   u32 BusClock;
+   u32 Best = 0;
+
+   int ReturnCode = clock_control_get_rate(ClockDevice, (clock_control_subsys_t)&SpiClock, &BusClock);
+   if (ReturnCode != 0)
+   {
+      LOG_ERR("Could not get the SPI bus clock %d", ReturnCode);
+      return ReturnCode;
+   }
+
+   for (u32 Shift = 1; Shift <= SPI_MAX_PRESCALER_SHIFT; ++Shift)
+   {
+      u32 Rate = BusClock >> (Shift + 1);
+      u32 BestRate = BusClock >> (Best + 1);
+      if (Abs((f32)Rate - STRIP_SPI_FREQUENCY) < Abs((f32)BestRate - STRIP_SPI_FREQUENCY))
+      {
+         Best = Shift;
+      }
+   }
+
+   u32 Rate = BusClock >> (Best + 1);
+   if (Abs((f32)Rate - STRIP_SPI_FREQUENCY) > STRIP_SPI_FREQUENCY * STRIP_SPI_TOLERANCE_PERCENT / 100)
+   {
+      LOG_ERR("No SPI rate close to %u Hz from a %u Hz bus, %u Hz is the closest",
+              STRIP_SPI_FREQUENCY, BusClock, Rate);
+      return -ENOTSUP;
+   }
+
+   LOG_INF("SPI at %u Hz, bus clock / %u", Rate, 2u << Best);
+   *Prescaler = Best << SPI_CR1_BR_Pos;
+
+   return 0;
+}
+
+int StripBackendInit()
+{
+   u32 Prescaler;
+
+   if (!device_is_ready(DmaDevice) || !device_is_ready(ClockDevice))
+   {
+      LOG_ERR("DMA for the strip is not ready");
+      return -ENODEV;
+   }
+
+   int ReturnCode = SpiPrescaler(&Prescaler);
+   if (ReturnCode != 0)
+   {
+      return ReturnCode;
+   }
+
+   k_sem_init(&Stream.Done, 0, 1);
+
+   /* The pins are already set up by the SPI driver */
+   ReturnCode = clock_control_on(ClockDevice, (clock_control_subsys_t)&SpiClock);
+   if (ReturnCode != 0)
+   {
+      LOG_ERR("Could not enable the SPI clock %d", ReturnCode);
+      return ReturnCode;
+   }
+   LL_SPI_Disable(STRIP_SPI);
+   LL_SPI_SetMode(STRIP_SPI, LL_SPI_MODE_MASTER);
+   LL_SPI_SetTransferDirection(STRIP_SPI, LL_SPI_HALF_DUPLEX_TX);
+   LL_SPI_SetDataWidth(STRIP_SPI, LL_SPI_DATAWIDTH_8BIT);
+   LL_SPI_SetClockPolarity(STRIP_SPI, LL_SPI_POLARITY_LOW);
+   LL_SPI_SetClockPhase(STRIP_SPI, LL_SPI_PHASE_1EDGE);
+   LL_SPI_SetNSSMode(STRIP_SPI, LL_SPI_NSS_SOFT);
+   LL_SPI_SetBaudRatePrescaler(STRIP_SPI, Prescaler);
+   LL_SPI_SetTransferBitOrder(STRIP_SPI, LL_SPI_MSB_FIRST);
+   LL_SPI_EnableDMAReq_TX(STRIP_SPI);
+   LL_SPI_Enable(STRIP_SPI);
+
+   LOG_INF("Streaming up to %u pixels through a %u byte ring", STRIP_MAX_PIXELS, (u32)sizeof(Ring));
+
+   return 0;
+}
+
+/* Only the ring is encoded ahead, any length fits */
+u32 StripBackendMaxPixels()
+{
+   return STRIP_MAX_PIXELS;
+}
+
+u32 StripBackendPush(pixel *Pixels, u32 NumOfPixels)
+{
+   Stream.Pixels = Pixels;
+   Stream.NumOfPixels = NumOfPixels;
+   Stream.Next = 0;
+   Stream.LatchSent = 0;
+   Stream.Latch[0] = StreamFill(0);
+   Stream.Latch[1] = StreamFill(1);
+
+   if (StreamConfig() != 0)
+   {
+      return 1;
+   }
+
+   k_sem_reset(&Stream.Done);
+   int ReturnCode = dma_start(DmaDevice, DMA_CHANNEL);
+   if (ReturnCode != 0)
+   {
+      LOG_ERR("Dma start failed %d", ReturnCode);
+      return 1;
+   }
+
+   if (k_sem_take(&Stream.Done, K_MSEC(PUSH_TIMEOUT_MS)) != 0)
+   {
+      LOG_ERR("Strip stream timed out");
+      dma_stop(DmaDevice, DMA_CHANNEL);
+      return 1;
+   }
+
+   return 0;
+}
+
+#else
+
+internal const struct spi_dt_spec StripSpi = SPI_DT_SPEC_GET(STRIP_NODE,
+      SPI_OP_MODE_MASTER | SPI_TRANSFER_MSB | SPI_WORD_SET(8), 0);
+
+internal struct spi_config StripSpiConfig;
+
+/* Nine times the pixel arena, too big to keep next to it in internal SRAM
+ * for long strips */
+internal u8 EncodeBuffer[STRIP_MAX_PIXELS * STRIP_BYTES_PER_PIXEL + STRIP_RESET_BYTES] FL_SDRAM;
+
+int StripBackendInit()
+{
+   if (!spi_is_ready(&StripSpi))
+   {
+      LOG_ERR("SPI bus %s is not ready", StripSpi.bus->name);
+      return -ENODEV;
+   }
+
+   StripSpiConfig = StripSpi.config;
+   StripSpiConfig.frequency = STRIP_SPI_FREQUENCY;
+
+   LOG_INF("Driving up to %u pixels on %s, %u bytes per frame", STRIP_MAX_PIXELS,
+         StripSpi.bus->name, (u32)sizeof(EncodeBuffer));
+
+   return 0;
+}
+
+u32 StripBackendMaxPixels()
+{
+   return STRIP_MAX_PIXELS;
+}
+
+u32 StripBackendPush(pixel *Pixels, u32 NumOfPixels)
+{
+   u8 *Out = EncodeBuffer;
+   u32 Start = PerfBegin();
+
+   for (u32 I = 0; I < NumOfPixels; ++I)
+   {
+      Out = EncodePixel(Out, &Pixels[I]);
+   }
+   memset(Out, 0, STRIP_RESET_BYTES);
+   Out += STRIP_RESET_BYTES;
+   PerfEnd(PERF_ENCODE, Start);
+
+   const struct spi_buf Buffer = {
+      .buf = EncodeBuffer,
+      .len = Out - EncodeBuffer,
+   };
+   const struct spi_buf_set Buffers = {
+      .buffers = &Buffer,
+      .count = 1,
+   };
+
+   int rc = spi_write(StripSpi.bus, &StripSpiConfig, &Buffers);
+   if (rc)
+   {
+      LOG_ERR("couldn't write strip: %d", rc);
+      return 1;
+   }
+
+   return 0;
+}
+
+#endif
+
+#endif
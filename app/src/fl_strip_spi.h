@@ -0,0 +1,55 @@
+#ifndef FL_STRIP_SPI_H__
+#define FL_STRIP_SPI_H__
+
+#include <string.h>
+#include "fl_common.h"
+#include "fl_strip.h"
+
+/* One SPI bit is 381 ns and three make one WS2812 bit: 0 is 100 (381 ns
+ * high), 1 is 110 (762 ns high), 1.14 us per bit */
+#define STRIP_SPI_FREQUENCY (2625000)
+#define STRIP_BYTES_PER_PIXEL (9)
+
+/* Four data bits become twelve SPI bits */
+internal const u16 NibbleLut[16] = {
+   0x924, 0x926, 0x934, 0x936, 0x9A4, 0x9A6, 0x9B4, 0x9B6,
+   0xD24, 0xD26, 0xD34, 0xD36, 0xDA4, 0xDA6, 0xDB4, 0xDB6,
+};
+
+internal inline u8 *EncodeByte(u8 *Out, u8 Value)
+{
+   u32 Bits = ((u32)NibbleLut[Value >> 4] << 12) | NibbleLut[Value & 0xF];
+
+   Out[0] = (u8)(Bits >> 16);
+   Out[1] = (u8)(Bits >> 8);
+   Out[2] = (u8)Bits;
+
+   return Out + 3;
+}
+
+/* Green, red, blue as in the strip color-mapping */
+internal inline u8 *EncodePixel(u8 *Out, pixel *Pixel)
+{
+   Out = EncodeByte(Out, Pixel->Color.g);
+   Out = EncodeByte(Out, Pixel->Color.r);
+   Out = EncodeByte(Out, Pixel->Color.b);
+
+   return Out;
+}
+
+/* Encodes up to ChunkPixels of the NumPixels left and zero fills the rest
+ * of the chunk, returns how many were encoded */
+internal inline u32 EncodeChunk(u8 *Out, pixel *Pixels, u32 NumPixels, u32 ChunkPixels)
+{
+   u32 Count = Minimum(NumPixels, ChunkPixels);
+
+   for (u32 I = 0; I < Count; ++I)
+   {
+      Out = EncodePixel(Out, &Pixels[I]);
+   }
+   memset(Out, 0, (ChunkPixels - Count) * STRIP_BYTES_PER_PIXEL);
+
+   return Count;
+}
+
+#endif /* FL_STRIP_SPI_H__ */
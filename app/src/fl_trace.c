@@ -0,0 +1,151 @@
+#include <string.h>
+#include <math.h>
+#include "fl_common.h"
+#include "fl_trace.h"
+#include "fl_perf.h"
+#include "fl_lights.h"
+#include "fl_memory.h"
+#include "zephyr.h"
+
+#if defined(CONFIG_FEELIGHTS_TRACE)
+
+#define TRACE_NUM_RECORDS CONFIG_FEELIGHTS_TRACE_FRAMES
+#define TRACE_BAND_OFFSET (160.0f)
+#define FNV_OFFSET (2166136261u)
+#define FNV_PRIME (16777619u)
+
+internal fl_trace_record Records[TRACE_NUM_RECORDS] FL_SDRAM;
+
+internal struct
+{
+   u32 Head;
+   u32 Count;
+   atomic_t Enabled;
+   atomic_t Dumping;
+} Trace;
+
+#define TRACE_STAGE_PROBE(Probe) Probe,
+internal const fl_perf_probe Stages[TRACE_NUM_STAGES] = {
+   TRACE_STAGES(TRACE_STAGE_PROBE)
+};
+
+u32 TraceInit()
+{
+   TraceClear();
+   atomic_set(&Trace.Enabled, 1);
+
+   return 0;
+}
+
+void TraceSetEnabled(bool Enabled)
+{
+   atomic_set(&Trace.Enabled, Enabled ? 1 : 0);
+}
+
+bool TraceIsEnabled()
+{
+   return atomic_get(&Trace.Enabled) != 0;
+}
+
+void TraceClear()
+{
+   atomic_set(&Trace.Dumping, 1);
+   memset(Records, 0, sizeof(Records));
+   Trace.Head = 0;
+   Trace.Count = 0;
+   atomic_set(&Trace.Dumping, 0);
+}
+
+u32 TraceCount()
+{
+   return Trace.Count;
+}
+
+internal u32 Checksum(const pixel *Pixels, u32 NumPixels)
+{
+   u32 Hash = FNV_OFFSET;
+
+   for (u32 I = 0; I < NumPixels; ++I)
+   {
+      Hash = (Hash ^ Pixels[I].Dword) * FNV_PRIME;
+   }
+
+   return Hash;
+}
+
+void TraceFrame(u32 Sequence, const u16 *Samples, u32 NumSamples,
+                const f32 *Bands, const pixel *Pixels, u32 NumPixels)
+{
+   if (!atomic_get(&Trace.Enabled) || atomic_get(&Trace.Dumping))
+   {
+      return;
+   }
+
+   fl_trace_record *Record = &Records[Trace.Head];
+   fl_orb_state Orbs[TRACE_MAX_ORBS];
+
+   Record->Sequence = Sequence;
+   Record->Timestamp = k_cycle_get_32();
+   for (u32 I = 0; I < TRACE_NUM_STAGES; ++I)
+   {
+      Record->StageCycles[I] = PerfLastCycles(Stages[I]);
+   }
+   u16 Rms;
+   u16 Peak;
+   DspSampleLevels(Samples, NumSamples, &Rms, &Peak);
+   Record->Rms = Rms;
+   Record->Peak = Peak;
+   Record->Checksum = Checksum(Pixels, NumPixels);
+   Record->NumPixels = (u16)Minimum(NumPixels, 0xFFFF);
+   Record->AmbientIntensity = (u8)Clamp(0.0f, LightsGetAmbientIntensity(), 255.0f);
+
+   u32 NumOrbs = Minimum(LightsGetOrbs(Orbs, TRACE_MAX_ORBS), TRACE_MAX_ORBS);
+   Record->NumOrbs = (u8)NumOrbs;
+   for (u32 I = 0; I < TRACE_MAX_ORBS; ++I)
+   {
+      bool Used = I < NumOrbs;
+      Record->Orbs[I].P = Used ? (u16)Clamp(0.0f, Orbs[I].P * 8.0f, 65535.0f) : 0;
+      Record->Orbs[I].R = Used ? (u8)Clamp(0.0f, Orbs[I].R * 16.0f, 255.0f) : 0;
+      Record->Orbs[I].Intensity = Used ? (u8)Clamp(0.0f, Orbs[I].Intensity, 255.0f) : 0;
+   }
+
+   for (u32 I = 0; I < CONFIG_FEELIGHTS_NUM_BANDS; ++I)
+   {
+      f32 Level = Bands[I] > 0.0f ? 8.0f * log2f(Bands[I]) + TRACE_BAND_OFFSET : 0.0f;
+      Record->Bands[I] = (u8)Clamp(0.0f, Level, 255.0f);
+   }
+
+   Trace.Head = (Trace.Head + 1) % TRACE_NUM_RECORDS;
+   Trace.Count++;
+}
+
+void TraceDump(fl_trace_writer Writer, void *Context)
+{
+   atomic_set(&Trace.Dumping, 1);
+
+   /* A frame that started recording before the dump may still be writing the
+    * slot at the head, which is the oldest one once the ring is full */
+   u32 Head = Trace.Head;
+   u32 Kept = Minimum(Trace.Count, TRACE_NUM_RECORDS - 1);
+   fl_trace_header Header = {
+      .Magic = TRACE_MAGIC,
+      .Version = TRACE_VERSION,
+      .NumStages = TRACE_NUM_STAGES,
+      .NumBands = CONFIG_FEELIGHTS_NUM_BANDS,
+      .MaxOrbs = TRACE_MAX_ORBS,
+      .RecordSize = sizeof(fl_trace_record),
+      .NumRecords = (u16)Kept,
+      .CyclesPerSecond = sys_clock_hw_cycles_per_sec(),
+   };
+
+   Writer(&Header, sizeof(Header), Context);
+   u32 First = (Head + TRACE_NUM_RECORDS - Kept) % TRACE_NUM_RECORDS;
+   for (u32 I = 0; I < Kept; ++I)
+   {
+      Writer(&Records[(First + I) % TRACE_NUM_RECORDS], sizeof(fl_trace_record), Context);
+   }
+
+   atomic_set(&Trace.Dumping, 0);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef FL_TRACE_H__
+#define FL_TRACE_H__
+
+#include "fl_common.h"
+#include "fl_strip.h"
+#include <toolchain.h>
+#include <stdbool.h>
+
+#define TRACE_MAGIC "FLTR"
+#define TRACE_VERSION (1)
+#define TRACE_MAX_ORBS (8)
+
+/* Stages recorded with every frame, in this order */
+#define TRACE_STAGES(X) X(PERF_STFT) X(PERF_NORMALIZE) X(PERF_FFT) X(PERF_BANDS) \
+                        X(PERF_BEAT) X(PERF_RENDER) X(PERF_FRAME)
+#define TRACE_COUNT_STAGE(Probe) + 1
+#define TRACE_NUM_STAGES (0 TRACE_STAGES(TRACE_COUNT_STAGE))
+
+/* Everything is little endian, scripts/fl_trace_decode.py reads the same layout */
+typedef struct __packed {
+   char Magic[4];
+   u8 Version;
+   u8 NumStages;
+   u8 NumBands;
+   u8 MaxOrbs;
+   u16 RecordSize;
+   u16 NumRecords;
+   u32 CyclesPerSecond;
+} fl_trace_header;
+
+typedef struct __packed {
+   u32 Sequence;
+   u32 Timestamp;
+   u32 StageCycles[TRACE_NUM_STAGES];
+   /* Raw ADC counts around the mean of the hop */
+   u16 Rms;
+   u16 Peak;
+   /* FNV-1a over the pixel words of the rendered frame */
+   u32 Checksum;
+   u16 NumPixels;
+   u8 AmbientIntensity;
+   u8 NumOrbs;
+   struct __packed {
+      /* Position in 1/8 pixel, radius in 1/16 pixel */
+      u16 P;
+      u8 R;
+      u8 Intensity;
+   } Orbs[TRACE_MAX_ORBS];
+   /* Eighths of an octave above 2^-20 */
+   u8 Bands[CONFIG_FEELIGHTS_NUM_BANDS];
+} fl_trace_record;
+
+typedef void (*fl_trace_writer)(const void *Data, u32 Size, void *Context);
+
+#if defined(CONFIG_FEELIGHTS_TRACE)
+
+u32 TraceInit();
+
+void TraceSetEnabled(bool Enabled);
+
+bool TraceIsEnabled();
+
+/* Only from the thread that calls TraceFrame */
+void TraceClear();
+
+/* Frames recorded since the last clear, at most CONFIG_FEELIGHTS_TRACE_FRAMES are kept */
+u32 TraceCount();
+
+/* Records the frame that was just handed to the strip, call after the
+ * PERF_FRAME probe ended so the recording is not part of the frame time */
+void TraceFrame(u32 Sequence, const u16 *Samples, u32 NumSamples,
+                const f32 *Bands, const pixel *Pixels, u32 NumPixels);
+
+/* Hands the header and then every kept record, oldest first, to the writer.
+ * Recording is paused meanwhile */
+void TraceDump(fl_trace_writer Writer, void *Context);
+
+#else
+
+internal inline u32 TraceInit() { return 0; }
+internal inline void TraceFrame(u32 Sequence, const u16 *Samples, u32 NumSamples,
+                                const f32 *Bands, const pixel *Pixels, u32 NumPixels) {}
+
+#endif
+
+#endif // FL_TRACE_H__
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define LOG_LEVEL 4
@@ -12,21 +13,14 @@ LOG_MODULE_REGISTER(main);
 #include "fl_events.h"
 #include "fl_strip.h"
 #include "fl_dsp.h"
+#include "fl_beat.h"
 #include "fl_lights.h"
 #include "fl_button.h"
+#include "fl_memory.h"
+#include "fl_perf.h"
+#include "fl_trace.h"
+#include "fl_quality.h"
 
-#ifdef CONFIG_TIMING_FUNCTIONS
-#include <timing/timing.h>
-/* TODO(kleindan)
- *
- * Spare:       1,152,334 ns
- * Fft:        11,032,024 ns
- * Update:        608,110 ns
- * Pixel:             738 ns
- * Total       12,793,208 ns
- */
-
-#endif
 
 static int cmd_demo_board(const struct shell *sh, size_t argc, char **argv)
 {
@@ -48,35 +42,561 @@ static int cmd_version(const struct shell *shell, size_t argc, char **argv)
 	return 0;
 }
 
+static int cmd_fl_audio(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	fl_audio_stats Stats;
+	AudioInGetStats(&Stats);
+
+	shell_print(sh, "captured %u, processed %u, missed %u, torn %u",
+		    Stats.FramesCaptured, Stats.FramesProcessed,
+		    Stats.FramesMissed, Stats.FramesTorn);
+
+	return 0;
+}
+
+static int cmd_fl_dsp(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+#ifdef CONFIG_FEELIGHTS_DSP_ACCURACY_CHECK
+	fl_dsp_accuracy Accuracy;
+	DspGetAccuracy(&Accuracy);
+
+	if (Accuracy.FramesCompared == 0 || Accuracy.ErrorEnergy == 0.0f)
+	{
+		shell_print(sh, "q15 vs f32: %u frames compared", Accuracy.FramesCompared);
+		return 0;
+	}
+
+	shell_print(sh, "q15 vs f32: %u frames, max error %f, SNR %.1f dB",
+		    Accuracy.FramesCompared, (double)Accuracy.MaxError,
+		    (double)(10.0f * log10f(Accuracy.ReferenceEnergy / Accuracy.ErrorEnergy)));
+#elif defined(CONFIG_FEELIGHTS_DSP_Q15)
+	shell_print(sh, "q15 engine, accuracy check disabled");
+#else
+	shell_print(sh, "f32 engine");
+#endif
+
+	return 0;
+}
+
+/* Picked up by the main loop between two frames */
+internal atomic_t StripLengthRequest;
+
+static int cmd_fl_strip(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		char *End;
+		unsigned long Length = strtoul(argv[1], &End, 10);
+
+		if (*End != '\0' || Length == 0 || Length > STRIP_MAX_PIXELS) {
+			shell_error(sh, "length has to be 1 to %u pixels", STRIP_MAX_PIXELS);
+			return -EINVAL;
+		}
+		atomic_set(&StripLengthRequest, (atomic_val_t)Length);
+	}
+
+	fl_strip_stats Stats;
+	StripGetStats(&Stats);
+
+	shell_print(sh, "%u of up to %u pixels", StripGetLength(), STRIP_MAX_PIXELS);
+	shell_print(sh, "rendered %u, pushed %u, skipped %u, errors %u",
+		    Stats.FramesRendered, Stats.FramesPushed,
+		    Stats.FramesSkipped, Stats.Errors);
+	shell_print(sh, "push time last %u us, max %u us",
+		    Stats.LastPushUs, Stats.MaxPushUs);
+
+	return 0;
+}
+
+static int cmd_fl_layer(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc == 4) {
+		char *End;
+		unsigned long Opacity = strtoul(argv[3], &End, 10);
+		fl_blend_mode Mode = ComposeModeFromName(argv[2]);
+
+		if (Mode == BLEND_MAX_IDX || *End != '\0' || Opacity > 255) {
+			shell_error(sh, "mode has to be add, max, alpha, multiply or fill, "
+				    "opacity 0 to 255");
+			return -EINVAL;
+		}
+		if (LightsSetLayer(argv[1], Mode, Opacity) != 0) {
+			shell_error(sh, "no layer %s", argv[1]);
+			return -EINVAL;
+		}
+	} else if (argc != 1) {
+		shell_error(sh, "either no arguments or a layer, mode and opacity");
+		return -EINVAL;
+	}
+
+	const fl_layer *Layers;
+	u32 NumLayers = LightsGetLayers(&Layers);
+
+	for (u32 I = 0; I < NumLayers; ++I) {
+		shell_print(sh, "%u %-8s %-8s opacity %3u, last frame %3u/256", I,
+			    Layers[I].Name, ComposeModeName(Layers[I].Mode),
+			    Layers[I].Opacity, Layers[I].Alpha);
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_FEELIGHTS_PERF)
+/* The probes are written from the loop and the push thread, so the main loop
+ * clears them between two frames */
+internal atomic_t PerfResetRequest;
+
+static int cmd_fl_perf(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		if (strcmp(argv[1], "reset") != 0) {
+			shell_error(sh, "unknown argument %s", argv[1]);
+			return -EINVAL;
+		}
+		atomic_set(&PerfResetRequest, 1);
+		return 0;
+	}
+
+	shell_print(sh, "%-10s %8s %8s %8s %8s %8s %8s", "probe", "count",
+		    "min us", "mean us", "p99 us", "max us", "overruns");
+	for (fl_perf_probe Probe = 0; Probe < PERF_MAX_IDX; ++Probe) {
+		fl_perf_stats Stats;
+		PerfGetStats(Probe, &Stats);
+		if (Stats.Count == 0) {
+			shell_print(sh, "%-10s %8u", PerfProbeName(Probe), 0);
+			continue;
+		}
+		shell_print(sh, "%-10s %8u %8u %8u %8u %8u %8u", PerfProbeName(Probe), Stats.Count,
+			    PerfCyclesToUs(Stats.MinCycles),
+			    PerfCyclesToUs((u32)(Stats.TotalCycles / Stats.Count)),
+			    PerfCyclesToUs(PerfPercentileCycles(&Stats, 990)),
+			    PerfCyclesToUs(Stats.MaxCycles), Stats.Overruns);
+	}
+
+	return 0;
+}
+#endif
+
+#if defined(CONFIG_FEELIGHTS_TRACE)
+#include <sys/base64.h>
+
+/* Every chunk is encoded on its own line, so a garbled line only costs one record */
+static void TraceShellWriter(const void *Data, u32 Size, void *Context)
+{
+	const struct shell *sh = Context;
+	u8 Line[(sizeof(fl_trace_record) + 2) / 3 * 4 + 1];
+	size_t Length;
+
+	if (base64_encode(Line, sizeof(Line), &Length, Data, Size) == 0) {
+		shell_print(sh, "%s", Line);
+	}
+}
+
+/* Frames are recorded by the main loop, which clears the ring between two */
+internal atomic_t TraceClearRequest;
+
+static int cmd_fl_trace(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc == 1) {
+		shell_print(sh, "%s, %u frames recorded, %u kept, %u bytes each",
+			    TraceIsEnabled() ? "on" : "off", TraceCount(),
+			    Minimum(TraceCount(), CONFIG_FEELIGHTS_TRACE_FRAMES - 1),
+			    (u32)sizeof(fl_trace_record));
+	} else if (strcmp(argv[1], "on") == 0) {
+		TraceSetEnabled(true);
+	} else if (strcmp(argv[1], "off") == 0) {
+		TraceSetEnabled(false);
+	} else if (strcmp(argv[1], "clear") == 0) {
+		atomic_set(&TraceClearRequest, 1);
+	} else if (strcmp(argv[1], "dump") == 0) {
+		shell_print(sh, "-----BEGIN FL TRACE-----");
+		TraceDump(TraceShellWriter, (void *)sh);
+		shell_print(sh, "-----END FL TRACE-----");
+	} else {
+		shell_error(sh, "unknown argument %s", argv[1]);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+static int cmd_fl_events(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	static const char *Names[EV_MAX_IDX] = {
+		[EV_AUDIO_SAMPLES_AVAILABLE] = "audio",
+		[EV_BUTTON_PRESSED] = "pressed",
+		[EV_BUTTON_RELEASED] = "released",
+		[EV_PERIODIC_FRAME] = "periodic",
+	};
+	fl_event_stats Stats;
+	EventsGetStats(&Stats);
+
+	for (fl_event Event = EV_START_IDX; Event < EV_MAX_IDX; Event++) {
+		shell_print(sh, "%-8s emitted %u, queued %u, max %u, overflows %u",
+			    Names[Event], Stats.Emitted[Event], Stats.Depth[Event],
+			    Stats.MaxDepth[Event], Stats.Overflows[Event]);
+	}
+
+	return 0;
+}
+
+static int cmd_fl_beat(const struct shell *sh, size_t argc, char **argv);
+#if defined(CONFIG_FEELIGHTS_IDLE)
+static int cmd_fl_idle(const struct shell *sh, size_t argc, char **argv);
+#endif
+#if defined(CONFIG_FEELIGHTS_QUALITY)
+static int cmd_fl_quality(const struct shell *sh, size_t argc, char **argv);
+#endif
+
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_demo,
 	SHELL_CMD(board, NULL, "Show board name command.", cmd_demo_board),
 	SHELL_SUBCMD_SET_END /* Array terminated. */
 );
 SHELL_CMD_REGISTER(demo, &sub_demo, "Demo commands", NULL);
 
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_fl,
+	SHELL_CMD(audio, NULL, "Show audio capture statistics.", cmd_fl_audio),
+	SHELL_CMD(dsp, NULL, "Show spectrum engine and q15 accuracy.", cmd_fl_dsp),
+#if defined(CONFIG_FEELIGHTS_PERF)
+	SHELL_CMD_ARG(perf, NULL, "Show per stage timing, p99 within a quarter octave.\n"
+		      "Usage: fl perf [reset]", cmd_fl_perf, 1, 1),
+#endif
+#if defined(CONFIG_FEELIGHTS_TRACE)
+	SHELL_CMD_ARG(trace, NULL, "Control the frame trace, dump it as base64.\n"
+		      "Usage: fl trace [on|off|clear|dump]", cmd_fl_trace, 1, 1),
+#endif
+	SHELL_CMD(events, NULL, "Show event queue depths and overflows.", cmd_fl_events),
+	SHELL_CMD(beat, NULL, "Show tempo, beat phase and tracker cost.", cmd_fl_beat),
+	SHELL_CMD_ARG(layer, NULL, "Show the light layers bottom up, set how one is blended.\n"
+		      "Usage: fl layer [name add|max|alpha|multiply|fill 0-255]", cmd_fl_layer, 1, 3),
+#if defined(CONFIG_FEELIGHTS_IDLE)
+	SHELL_CMD(idle, NULL, "Show whether the silence idle is on and how long it was.", cmd_fl_idle),
+#endif
+#if defined(CONFIG_FEELIGHTS_QUALITY)
+	SHELL_CMD_ARG(quality, NULL, "Show the quality level and its changes, pin a level.\n"
+		      "Usage: fl quality [0-4|auto]", cmd_fl_quality, 1, 1),
+#endif
+	SHELL_CMD_ARG(strip, NULL, "Show strip push statistics, set the strip length.\n"
+		      "Usage: fl strip [pixels]", cmd_fl_strip, 1, 1),
+	SHELL_SUBCMD_SET_END /* Array terminated. */
+);
+SHELL_CMD_REGISTER(fl, &sub_fl, "FeeLights commands", NULL);
+
 SHELL_CMD_ARG_REGISTER(version, NULL, "Show kernel version", cmd_version, 1, 0);
 
 
-#define NUM_SAMPLES (1024)
-#define SAMPLE_INDEX_MASK  ((NUM_SAMPLES * 2) - 1)
-#define NUM_OF_PIXELS (123)
+#define NUM_SAMPLES CONFIG_FEELIGHTS_FFT_SIZE
+#define HOP_SAMPLES CONFIG_FEELIGHTS_HOP_SIZE
+#define HOP_RATE ((f32)AUDIOIN_SAMPLING_FREQUENCY / (f32)HOP_SAMPLES)
+/* The lights are drawn from their own timer instead of on every hop */
+#define RENDER_DECOUPLED (CONFIG_FEELIGHTS_RENDER_RATE > 0)
+#define NUM_BANDS CONFIG_FEELIGHTS_NUM_BANDS
+BUILD_ASSERT((NUM_SAMPLES & (NUM_SAMPLES - 1)) == 0,
+             "CONFIG_FEELIGHTS_FFT_SIZE has to be a power of two");
+#define BANDS_MIN_FREQUENCY (40.0f)
+#define BANDS_MAX_FREQUENCY (10000.0f)
+#define STRIP_LENGTH_TIMEOUT_MS (100)
+#define LOOP_STACKSIZE 2048
+#define LOOP_PRIORITY CONFIG_MAIN_THREAD_PRIORITY
+
+/* The ADC DMA target has to stay in SRAM, everything the frame touches
+ * after it was copied out goes to CCM */
+internal u16 SampleBuffer[2*HOP_SAMPLES];
+internal u16 StftHistory[2*NUM_SAMPLES] FL_CCM;
+internal fl_stft Stft FL_CCM;
+/* Sequence of the last frame pushed into the history */
+internal u32 StftSequence;
+internal u32 DspBuffer[DSP_BUFFER_SIZE(NUM_SAMPLES) / sizeof(u32)] FL_CCM;
+internal fl_dsp Dsp FL_CCM;
+internal fl_band Bands[NUM_BANDS] FL_CCM;
+internal f32 BandWeights[DSP_FILTERBANK_MAX_WEIGHTS(NUM_SAMPLES, NUM_BANDS)] FL_CCM;
+internal f32 BandEnergies[NUM_BANDS] FL_CCM;
+internal fl_bin_sum SpectrumCumulative[NUM_SAMPLES / 2 + 1] FL_CCM;
+internal fl_beat BeatState FL_CCM;
+internal fl_audio_features Features FL_CCM;
+/* The one the spectrum is calculated with */
+internal fl_dsp *ActiveDsp = &Dsp;
+
+/* The event loop runs the whole frame, its own thread lets the stack go to
+ * CCM as well */
+FL_CCM_STACK_DEFINE(LoopStack, LOOP_STACKSIZE);
+internal struct k_thread LoopThread;
+
+static int cmd_fl_beat(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	fl_beat_stats Stats;
+	BeatGetStats(&Stats);
 
-internal int16_t SampleBuffer[2*NUM_SAMPLES];
-internal f32 FftInput[NUM_SAMPLES];
-internal f32 FftComplex[NUM_SAMPLES];
-internal f32 FftOut[NUM_SAMPLES/2];
+	shell_print(sh, "%.1f BPM, confidence %.2f, phase %.2f, beat %u of the bar",
+		    (double)BeatState.Bpm, (double)BeatState.Confidence,
+		    (double)BeatState.Phase, BeatState.BeatInBar + 1);
+	shell_print(sh, "%u updates, last %u cycles, max %u cycles",
+		    Stats.Updates, Stats.LastCycles, Stats.MaxCycles);
+
+	return 0;
+}
+
+#if defined(CONFIG_FEELIGHTS_WINDOW_BLACKMAN)
+#define DSP_WINDOW DSP_WINDOW_BLACKMAN
+#elif defined(CONFIG_FEELIGHTS_WINDOW_RECTANGULAR)
+#define DSP_WINDOW DSP_WINDOW_RECTANGULAR
+#else
+#define DSP_WINDOW DSP_WINDOW_HANN
+#endif
 internal pixel *Pixels;
+internal u32 NumPixels;
+
+#if defined(CONFIG_FEELIGHTS_IDLE)
+#define IDLE_DELAY_HOPS ((u32)(CONFIG_FEELIGHTS_IDLE_DELAY * HOP_RATE))
+#define IDLE_HOPS_PER_FRAME Maximum((u32)(HOP_RATE / CONFIG_FEELIGHTS_IDLE_FRAME_RATE), 1)
+
+internal struct
+{
+   bool Active;
+   u32 QuietHops;
+   /* Since the current idle started */
+   u32 Hops;
+   u32 Entered;
+   u32 TotalHops;
+   u16 LastRms;
+   u16 LastPeak;
+} Idle;
+
+static int cmd_fl_idle(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "%s, last hop rms %u peak %u, thresholds %u and %u",
+		    Idle.Active ? "idle" : "listening", Idle.LastRms, Idle.LastPeak,
+		    CONFIG_FEELIGHTS_IDLE_RMS, CONFIG_FEELIGHTS_IDLE_PEAK);
+	shell_print(sh, "idled %u times, %u s in total",
+		    Idle.Entered, (u32)(Idle.TotalHops / HOP_RATE));
+
+	return 0;
+}
+
+internal inline bool IdleIsActive()
+{
+   return Idle.Active;
+}
+
+internal void IdleReset()
+{
+   Idle.Active = false;
+   Idle.QuietHops = 0;
+}
+
+/* Returns true while it is silent enough to idle, the hop has then been
+ * handled and only the idle animation rendered, at a low frame rate */
+internal bool IdleUpdate(const u16 *Samples)
+{
+   DspSampleLevels(Samples, HOP_SAMPLES, &Idle.LastRms, &Idle.LastPeak);
+
+   if (Idle.LastRms >= CONFIG_FEELIGHTS_IDLE_RMS || Idle.LastPeak >= CONFIG_FEELIGHTS_IDLE_PEAK)
+   {
+      if (Idle.Active)
+      {
+         LOG_INF("Sound is back after %u s", (u32)(Idle.Hops / HOP_RATE));
+      }
+      IdleReset();
+      return false;
+   }
+
+   if (!Idle.Active)
+   {
+      if (++Idle.QuietHops < IDLE_DELAY_HOPS)
+      {
+         return false;
+      }
+      LOG_INF("Silent for %u s, idling", CONFIG_FEELIGHTS_IDLE_DELAY);
+      Idle.Active = true;
+      Idle.Hops = 0;
+      Idle.Entered++;
+   }
+
+   if (Idle.Hops % IDLE_HOPS_PER_FRAME == 0)
+   {
+      LightsRenderIdle(Pixels, NumPixels, (f32)Idle.Hops / HOP_RATE);
+      StripOutput(Pixels, NumPixels);
+      Pixels = StripSwapBuffer(Pixels);
+   }
+   Idle.Hops++;
+   Idle.TotalHops++;
+
+   return true;
+}
+#else
+internal inline bool IdleIsActive() { return false; }
+internal inline void IdleReset() {}
+internal inline bool IdleUpdate(const u16 *Samples) { return false; }
+#endif
+
+#if defined(CONFIG_FEELIGHTS_QUALITY)
+#define QUALITY_HOLD_HOPS ((u32)(CONFIG_FEELIGHTS_QUALITY_HOLD * HOP_RATE))
+#define SMALL_SAMPLES (NUM_SAMPLES / 2)
 
-#ifdef CONFIG_TIMING_FUNCTIONS
-internal uint64_t TotalCycles = 0, TotalNs = 0;
-internal uint64_t SamplesCycles = 0, SamplesNs = 0;
-internal uint64_t FftCycles = 0, FftNs = 0;
-internal uint64_t UpdateCycles = 0, UpdateNs = 0;
-internal uint64_t PixelPushCycles = 0, PixelPushNs = 0;
-internal timing_t TStart, TSamplesReady, TFftDone, TUpdateDone, TPixelPushed;
-internal u32 TimingCount = 0;
+/* Analysis at QUALITY_SMALL_FFT and up, the cumulative sum is shared */
+internal u32 SmallDspBuffer[DSP_BUFFER_SIZE(SMALL_SAMPLES) / sizeof(u32)] FL_CCM;
+internal fl_dsp SmallDsp FL_CCM;
+internal fl_band SmallBands[NUM_BANDS] FL_CCM;
+internal f32 SmallBandWeights[DSP_FILTERBANK_MAX_WEIGHTS(SMALL_SAMPLES, NUM_BANDS)] FL_CCM;
+
+internal fl_quality_level QualityLevel;
+internal u32 QualityHops;
+
+static int cmd_fl_quality(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		char *End;
+		unsigned long Level = strtoul(argv[1], &End, 10);
+
+		if (strcmp(argv[1], "auto") == 0) {
+			QualityPin(QUALITY_MAX_IDX);
+		} else if (*End == '\0' && Level < QUALITY_MAX_IDX) {
+			QualityPin((fl_quality_level)Level);
+		} else {
+			shell_error(sh, "level has to be 0 to %u or auto", QUALITY_MAX_IDX - 1);
+			return -EINVAL;
+		}
+	}
+
+	fl_quality_stats Stats;
+	QualityGetStats(&Stats);
+
+	shell_print(sh, "level %u (%s), %s, budget %u us", Stats.Level,
+		    QualityLevelName(Stats.Level),
+		    Stats.Pinned < QUALITY_MAX_IDX ? "pinned" : "auto",
+		    PerfCyclesToUs(Stats.BudgetCycles));
+	shell_print(sh, "stepped down %u, up %u times, %u frames at risk, %u over budget",
+		    Stats.StepsDown, Stats.StepsUp, Stats.AtRisk, Stats.Overruns);
+	for (fl_quality_level Level = 0; Level < QUALITY_MAX_IDX; ++Level) {
+		shell_print(sh, "%u %-10s %8u frames", Level, QualityLevelName(Level),
+			    Stats.Frames[Level]);
+	}
+
+	return 0;
+}
+
+internal int QualityInitDsp()
+{
+   int Result = DspInit(&SmallDsp, SMALL_SAMPLES, DSP_WINDOW, SmallDspBuffer);
+   if (Result != 0)
+   {
+      return Result;
+   }
+   DspBandsInit(&SmallDsp, NUM_BANDS, AUDIOIN_SAMPLING_FREQUENCY,
+                BANDS_MIN_FREQUENCY, BANDS_MAX_FREQUENCY, SmallBands, SmallBandWeights);
+
+   return QualityInit(PerfBudgetCycles(PERF_FRAME), QUALITY_HOLD_HOPS);
+}
+
+/* Only what changed between the two levels is touched */
+internal void QualityApply(fl_quality_level From, fl_quality_level To)
+{
+   if ((From >= QUALITY_FEWER_ORBS) != (To >= QUALITY_FEWER_ORBS))
+   {
+      LightsSetOrbCount(To >= QUALITY_FEWER_ORBS ? CONFIG_FEELIGHTS_MAX_ORBS / 2 :
+                                                   CONFIG_FEELIGHTS_MAX_ORBS);
+   }
+
+   LightsSetAmbient(To < QUALITY_NO_AMBIENT);
+
+   ActiveDsp = To >= QUALITY_SMALL_FFT ? &SmallDsp : &Dsp;
+   Features.Spectrum = ActiveDsp->Spectrum;
+   Features.NumBins = ActiveDsp->FftSize / 2;
+   Features.BinScale = (f32)ActiveDsp->FftSize / (f32)NUM_SAMPLES;
+}
+
+/* Whether the lights are rendered for this hop, or render tick */
+internal inline bool QualityRenderHop()
+{
+   return QualityLevel < QUALITY_HALF_RATE || (QualityHops++ & 1) == 0;
+}
+
+/* Takes the time of the frame that just ended and of the renders since the
+ * one before, the next hop is handled at the level picked from it */
+internal void QualityUpdate(u32 RenderCycles)
+{
+   fl_quality_level Level = QualityFrameDone(PerfLastCycles(PERF_FRAME) + RenderCycles);
+
+   if (Level != QualityLevel)
+   {
+      QualityApply(QualityLevel, Level);
+      QualityLevel = Level;
+   }
+}
+#else
+internal inline int QualityInitDsp() { return 0; }
+internal inline bool QualityRenderHop() { return true; }
+internal inline void QualityUpdate(u32 RenderCycles) {}
 #endif
 
+#define RENDER_PERIOD_US (RENDER_DECOUPLED ? 1000000 / Maximum(CONFIG_FEELIGHTS_RENDER_RATE, 1) : 0)
+
+internal struct
+{
+   /* Nothing is drawn before the first analysed frame */
+   bool Updated;
+   /* k_cycle_get_32() at the last LightsUpdate */
+   u32 LastUpdate;
+   u32 HopCycles;
+   u32 PeriodUs;
+   /* Spent rendering since the last analysed frame */
+   u32 Cycles;
+   pixel *Presented;
+} Render;
+
+/* Never faster than the strip takes the frames */
+internal void RenderStart()
+{
+   Render.Updated = false;
+   Render.Cycles = 0;
+   Render.HopCycles = (u32)((u64)sys_clock_hw_cycles_per_sec() * HOP_SAMPLES /
+                            AUDIOIN_SAMPLING_FREQUENCY);
+   Render.PeriodUs = Maximum(RENDER_PERIOD_US, StripFrameUs());
+   EventsStartPeriodicEventUs(Render.PeriodUs);
+}
+
+internal void RenderStop()
+{
+   EventsStopPeriodicEvent();
+}
+
+/* Blends from the update before the last one, so the lights trail the
+ * audio by up to one more hop */
+internal void RenderTick(fl_event_message *Message)
+{
+   if (!Render.Updated || IdleIsActive() || EventsPending(EV_PERIODIC_FRAME) > 0 ||
+       !QualityRenderHop())
+   {
+      return;
+   }
+
+   f32 Blend = (f32)(i32)(Message->Timestamp - Render.LastUpdate) / (f32)Render.HopCycles;
+   u32 Start = PerfBegin();
+   LightsRender(Pixels, NumPixels, Clamp(0.0f, Blend, 1.0f));
+   Render.Cycles += PerfBegin() - Start;
+   PerfEnd(PERF_RENDER, Start);
+
+   StripOutput(Pixels, NumPixels);
+   Render.Presented = Pixels;
+   Pixels = StripSwapBuffer(Pixels);
+}
+
+
 typedef enum {
    MODE_NORMAL,
    MODE_INSPECTION,
@@ -86,18 +606,18 @@ typedef enum {
 
 
 internal void           ModeNormalOnEnter();
-internal fl_system_mode ModeNormalOnEvent(fl_event Event);
+internal fl_system_mode ModeNormalOnEvent(fl_event_message *Message);
 internal void           ModeNormalOnLeave();
 
 internal void           ModeInspectionOnEnter();
-internal fl_system_mode ModeInspectionOnEvent(fl_event Event);
+internal fl_system_mode ModeInspectionOnEvent(fl_event_message *Message);
 internal void           ModeInspectionOnLeave();
 
 internal void           ModeBrownOutOnEnter();
-internal fl_system_mode ModeBrownOutOnEvent(fl_event Event);
+internal fl_system_mode ModeBrownOutOnEvent(fl_event_message *Message);
 internal void           ModeBrownOutOnLeave();
 
-typedef fl_system_mode (*mode_event_handler_t)(fl_event);
+typedef fl_system_mode (*mode_event_handler_t)(fl_event_message *);
 typedef void (*mode_enter_handler_t)();
 typedef void (*mode_leave_handler_t)();
 
@@ -139,16 +659,16 @@ internal void ModeInspectionOnEnter()
       },
    };
 
-   for (int I = 0; I < NUM_OF_PIXELS; ++I)
+   for (u32 I = 0; I < NumPixels; ++I)
    {
       Pixels[I].Dword = RED.Dword;
    }
 
-   StripOutput(Pixels, NUM_OF_PIXELS);
+   StripOutput(Pixels, NumPixels);
    Pixels = StripSwapBuffer(Pixels);
 }
 
-internal fl_system_mode ModeInspectionOnEvent(fl_event Event)
+internal fl_system_mode ModeInspectionOnEvent(fl_event_message *Message)
 {
    fl_system_mode NextMode = MODE_INSPECTION;
 
@@ -166,7 +686,7 @@ internal fl_system_mode ModeInspectionOnEvent(fl_event Event)
    };
    static u32 CurrentColor = 0;
 
-   switch (Event)
+   switch (Message->Type)
    {
       case EV_PERIODIC_FRAME:
          break;
@@ -182,13 +702,13 @@ internal fl_system_mode ModeInspectionOnEvent(fl_event Event)
          }
          else
          {
-            for (int I = 0; I < NUM_OF_PIXELS; ++I)
+            for (u32 I = 0; I < NumPixels; ++I)
             {
                Pixels[I].Dword = GREEN_BLUE[CurrentColor].Dword;
             }
             CurrentColor++;
 
-            StripOutput(Pixels, NUM_OF_PIXELS);
+            StripOutput(Pixels, NumPixels);
             Pixels = StripSwapBuffer(Pixels);
          }
          break;
@@ -204,7 +724,9 @@ internal void ModeInspectionOnLeave()
    /* Nothing to do really? */
 }
 
-internal void ModeBrownOutOnEnter()
+/* Every other tick lights all pixels, the rest only every other pixel. The
+ * pattern is drawn again each time since the buffers rotate */
+internal void BrownOutDraw(u32 Tick)
 {
    static const pixel ALL = {
       .Color = {
@@ -214,14 +736,9 @@ internal void ModeBrownOutOnEnter()
       },
    };
 
-   for (int I = 0; I < NUM_OF_PIXELS; ++I)
-   {
-      Pixels[I].Dword = ALL.Dword;
-   }
-   Pixels = StripSwapBuffer(Pixels);
-   for (int I = 0; I < NUM_OF_PIXELS; ++I)
+   for (u32 I = 0; I < NumPixels; ++I)
    {
-      if ((I % 2) == 0)
+      if ((Tick % 2) == 0 || (I % 2) == 0)
       {
          Pixels[I].Dword = ALL.Dword;
       }
@@ -231,22 +748,26 @@ internal void ModeBrownOutOnEnter()
       }
    }
 
+   StripOutput(Pixels, NumPixels);
    Pixels = StripSwapBuffer(Pixels);
-   StripOutput(Pixels, NUM_OF_PIXELS);
-   Pixels = StripSwapBuffer(Pixels);
+}
+
+
+internal void ModeBrownOutOnEnter()
+{
+   BrownOutDraw(0);
 
    EventsStartPeriodicEvent(1000);
 }
 
-internal fl_system_mode ModeBrownOutOnEvent(fl_event Event)
+internal fl_system_mode ModeBrownOutOnEvent(fl_event_message *Message)
 {
    fl_system_mode NextMode = MODE_BROWNOUT;
 
-   switch (Event)
+   switch (Message->Type)
    {
       case EV_PERIODIC_FRAME:
-         StripOutput(Pixels, NUM_OF_PIXELS);
-         Pixels = StripSwapBuffer(Pixels);
+         BrownOutDraw(Message->Periodic.Count);
          break;
       case EV_AUDIO_SAMPLES_AVAILABLE:
          break;
@@ -269,93 +790,150 @@ internal void ModeBrownOutOnLeave()
 
 internal void ModeNormalOnEnter()
 {
-#ifdef CONFIG_TIMING_FUNCTIONS
-   timing_init();
-   timing_start();
-   TStart = timing_counter_get();
-#endif
-   for (int I = 0; I < NUM_OF_PIXELS; ++I)
+   for (u32 I = 0; I < NumPixels; ++I)
    {
       Pixels[I].Dword = 0;
    }
-   StripOutput(Pixels, NUM_OF_PIXELS);
+   StripOutput(Pixels, NumPixels);
    Pixels = StripSwapBuffer(Pixels);
+   IdleReset();
+   /* The audio from before the mode was left does not lead into the new one */
+   DspStftReset(&Stft);
+   if (RENDER_DECOUPLED)
+   {
+      RenderStart();
+   }
    AudioInStart();
 
 }
 internal void ModeNormalOnLeave()
 {
    AudioInStop();
-#ifdef CONFIG_TIMING_FUNCTIONS
-   timing_stop();
-#endif
+   if (RENDER_DECOUPLED)
+   {
+      RenderStop();
+   }
 }
 
-internal inline fl_system_mode ModeNormalOnEvent(fl_event Event)
+internal inline fl_system_mode ModeNormalOnEvent(fl_event_message *Message)
 {
-   static u32 AudioSampleIndex = 0;
    fl_system_mode NextMode = MODE_NORMAL;
+   fl_audio_frame Frame;
+   u16 *Window;
+   u32 FrameStart;
+   u32 Start;
+   pixel *Rendered;
 
-   switch (Event)
+   switch (Message->Type)
    {
       case EV_PERIODIC_FRAME:
+         if (RENDER_DECOUPLED)
+         {
+            RenderTick(Message);
+         }
          break;
       case EV_AUDIO_SAMPLES_AVAILABLE:
-#ifdef CONFIG_TIMING_FUNCTIONS
-         TSamplesReady = timing_counter_get();
-#endif
-         DspNormalizeSamples(&SampleBuffer[AudioSampleIndex], NUM_SAMPLES, FftInput);
-         DspCalculateSpectrum(FftInput, NUM_SAMPLES, FftComplex, FftOut);
-         AudioSampleIndex = (AudioSampleIndex + NUM_SAMPLES) & SAMPLE_INDEX_MASK;
-#ifdef CONFIG_TIMING_FUNCTIONS
-         TFftDone = timing_counter_get();
+         if (EventsPending(EV_AUDIO_SAMPLES_AVAILABLE) > 0)
+         {
+            /* A newer half is already queued and the DMA is filling this one
+             * again, skip straight to the newer one */
+            break;
+         }
+         if (!AudioInGetFrame(Message, &Frame))
+         {
+            break;
+         }
+         if (Frame.Sequence != StftSequence + 1)
+         {
+            /* Halves were missed or skipped, the window would splice audio
+             * that does not follow on */
+            DspStftReset(&Stft);
+         }
+         FrameStart = PerfBegin();
+         Window = DspStftPush(&Stft, Frame.Samples, Frame.NumSamples);
+         PerfEnd(PERF_STFT, FrameStart);
+         /* Only checked once the copy is done, the DMA may have come back
+          * to the half while it was being copied */
+         if (!AudioInReleaseFrame(&Frame))
+         {
+            /* The DMA caught up with us, the torn samples must not stay in
+             * the window */
+            DspStftReset(&Stft);
+            break;
+         }
+         StftSequence = Frame.Sequence;
+         if (Window == NULL)
+         {
+            /* Not enough history for a full window yet */
+            break;
+         }
+         if (IdleUpdate(Window + NUM_SAMPLES - HOP_SAMPLES))
+         {
+            /* The window keeps filling, so the first loud hop is analysed
+             * in full right away */
+            break;
+         }
+         Start = PerfBegin();
+         /* A smaller FFT looks at the newest part of the window */
+         DspNormalizeSamples(ActiveDsp, Window + NUM_SAMPLES - ActiveDsp->FftSize);
+         PerfEnd(PERF_NORMALIZE, Start);
+         Start = PerfBegin();
+         DspCalculateSpectrum(ActiveDsp);
+         PerfEnd(PERF_FFT, Start);
+         Start = PerfBegin();
+         DspCalculateBands(ActiveDsp, BandEnergies);
+         DspCalculateCumulative(ActiveDsp, SpectrumCumulative);
+         PerfEnd(PERF_BANDS, Start);
+         Start = PerfBegin();
+         BeatUpdate(BandEnergies, &BeatState);
+         PerfEnd(PERF_BEAT, Start);
+#ifdef CONFIG_FEELIGHTS_DSP_ACCURACY_CHECK
+         if (ActiveDsp == &Dsp)
+         {
+            DspAccuracyCheck(&Dsp, Window);
+         }
 #endif
 
-         LightsUpdateAndRender(Pixels, NUM_OF_PIXELS, FftOut, NUM_SAMPLES);
-#ifdef CONFIG_TIMING_FUNCTIONS
-         TUpdateDone = timing_counter_get();
-#endif
+         if (RENDER_DECOUPLED)
+         {
+            /* Only the orb and ambient targets move here, the render ticks
+             * draw them */
+            LightsUpdate(&Features);
+            PerfEnd(PERF_FRAME, FrameStart);
+            Render.LastUpdate = k_cycle_get_32();
+            Render.Updated = true;
+            QualityUpdate(Render.Cycles);
+            Render.Cycles = 0;
+            TraceFrame(Frame.Sequence, Window + NUM_SAMPLES - HOP_SAMPLES, HOP_SAMPLES,
+                       BandEnergies, Render.Presented, Render.Presented ? NumPixels : 0);
+            break;
+         }
 
-         StripOutput(Pixels, NUM_OF_PIXELS);
-         Pixels = StripSwapBuffer(Pixels);
-#ifdef CONFIG_TIMING_FUNCTIONS
-         TPixelPushed = timing_counter_get();
-         timing_stop();
-#endif
-#ifdef CONFIG_TIMING_FUNCTIONS
-         SamplesCycles     = timing_cycles_get(&TStart, &TSamplesReady);
-         FftCycles         = timing_cycles_get(&TSamplesReady, &TFftDone);
-         UpdateCycles      = timing_cycles_get(&TFftDone, &TUpdateDone);
-         PixelPushCycles   = timing_cycles_get(&TUpdateDone, &TPixelPushed);
-         TotalCycles       = timing_cycles_get(&TStart, &TPixelPushed);
-
-         SamplesNs        += timing_cycles_to_ns(SamplesCycles);
-         FftNs            += timing_cycles_to_ns(FftCycles);
-         UpdateNs         += timing_cycles_to_ns(UpdateCycles);
-         PixelPushNs      += timing_cycles_to_ns(PixelPushCycles);
-         TotalNs          += timing_cycles_to_ns(TotalCycles);
-
-         TimingCount = (TimingCount + 1) & 0xFF;
-         if (0 == TimingCount)
+         /* The lights follow every hop, so no beat is missed at half rate,
+          * only the drawing is skipped */
+         LightsUpdate(&Features);
+         if (!QualityRenderHop())
          {
-            SamplesNs    >>= 8;
-            FftNs        >>= 8;
-            UpdateNs     >>= 8;
-            PixelPushNs  >>= 8;
-            TotalNs      >>= 8;
-
-            LOG_INF("Samples: %lldns, Fft: %lldns, Update: %lldns, Pixel: %lldns, Total %lldns", SamplesNs, FftNs, UpdateNs, PixelPushNs, TotalNs);
-
-            SamplesNs    = 0;
-            FftNs        = 0;
-            UpdateNs     = 0;
-            PixelPushNs  = 0;
-            TotalNs      = 8;
+            PerfEnd(PERF_FRAME, FrameStart);
+            QualityUpdate(0);
+            break;
          }
 
-         timing_start();
-         TStart = timing_counter_get();
-#endif
+         Start = PerfBegin();
+         LightsRender(Pixels, NumPixels, 1.0f);
+         PerfEnd(PERF_RENDER, Start);
+
+         StripOutput(Pixels, NumPixels);
+         Rendered = Pixels;
+         Pixels = StripSwapBuffer(Pixels);
+         PerfEnd(PERF_FRAME, FrameStart);
+         QualityUpdate(0);
+
+         /* The strip only reads the presented buffer, it can be checksummed
+          * here. The hop is read from the history, the DMA may be refilling
+          * the capture half by now */
+         TraceFrame(Frame.Sequence, Window + NUM_SAMPLES - HOP_SAMPLES, HOP_SAMPLES,
+                    BandEnergies, Rendered, NumPixels);
          break;
       case EV_BUTTON_PRESSED:
          break;
@@ -369,26 +947,59 @@ internal inline fl_system_mode ModeNormalOnEvent(fl_event Event)
    return NextMode;
 }
 
-void main(void)
+/* Blanks the old length before it is cut, the buffers have room for the new one */
+internal void ApplyStripLength(u32 Length)
 {
-   Pixels = StripGetBuffer();
-
-   EventsInit();
-   StripInit();
-   LightsInit();
-   ButtonInit();
-   AudioInInit(SampleBuffer, sizeof(SampleBuffer));
-
-   StripOutput(Pixels, NUM_OF_PIXELS);
+   for (u32 I = 0; I < NumPixels; ++I)
+   {
+      Pixels[I].Dword = 0;
+   }
+   StripOutput(Pixels, NumPixels);
    Pixels = StripSwapBuffer(Pixels);
+   StripWaitForPush(STRIP_LENGTH_TIMEOUT_MS);
 
+   NumPixels = StripSetLength(Length);
+   LightsSetLength(NumPixels);
+   /* Drawn at the old length */
+   Render.Presented = NULL;
+   LOG_INF("Strip length set to %u pixels", NumPixels);
+}
+
+internal void EventLoop(void *P1, void *P2, void *P3)
+{
    fl_system_mode CurrentMode = MODE_NORMAL;
    ModeHandlers[CurrentMode].OnEnter();
 
 	while (1) {
-      fl_event Event = WaitForEvent(ModeTimeouts[CurrentMode]);
+      fl_event_message Message;
+      WaitForEvent(ModeTimeouts[CurrentMode], &Message);
+
+      u32 Length = (u32)atomic_set(&StripLengthRequest, 0);
+      if (Length != 0)
+      {
+         ApplyStripLength(Length);
+         if (RENDER_DECOUPLED && CurrentMode == MODE_NORMAL)
+         {
+            /* A longer strip takes longer on the wire */
+            RenderStart();
+         }
+      }
+
+#if defined(CONFIG_FEELIGHTS_PERF)
+      if (atomic_set(&PerfResetRequest, 0) != 0)
+      {
+         StripWaitForPush(STRIP_LENGTH_TIMEOUT_MS);
+         PerfReset();
+      }
+#endif
+#if defined(CONFIG_FEELIGHTS_TRACE)
+      if (atomic_set(&TraceClearRequest, 0) != 0)
+      {
+         TraceClear();
+      }
+#endif
 
-      fl_system_mode NextMode = ModeHandlers[CurrentMode].OnEvent(Event);
+      fl_system_mode NextMode = ModeHandlers[CurrentMode].OnEvent(&Message);
 
       if (NextMode != CurrentMode)
       {
@@ -399,3 +1010,53 @@ void main(void)
 	}
 }
 
+void main(void)
+{
+   Pixels = StripGetBuffer();
+
+   PerfInit();
+   /* A frame has to be done before the next hop of samples is captured */
+   PerfSetBudget(PERF_FRAME, (u32)((u64)HOP_SAMPLES * 1000000 / AUDIOIN_SAMPLING_FREQUENCY));
+   TraceInit();
+   EventsInit();
+   if (StripInit() != 0)
+   {
+      LOG_ERR("No strip to show the lights on, not starting");
+      return;
+   }
+   NumPixels = StripSetLength(CONFIG_FEELIGHTS_STRIP_LENGTH > 0 ?
+                              CONFIG_FEELIGHTS_STRIP_LENGTH : STRIP_NUM_PIXELS);
+   LightsInit((f32)AUDIOIN_SAMPLING_FREQUENCY / (f32)HOP_SAMPLES, NUM_BANDS, NumPixels,
+              CONFIG_FEELIGHTS_LIGHTS_SEED ? CONFIG_FEELIGHTS_LIGHTS_SEED : sys_rand32_get());
+   ButtonInit();
+   /* Neither the FFT nor the tracker may run without their setup */
+   if (DspInit(&Dsp, NUM_SAMPLES, DSP_WINDOW, DspBuffer) != 0 ||
+       BeatInit(HOP_RATE, NUM_BANDS) != 0 ||
+       QualityInitDsp() != 0)
+   {
+      LOG_ERR("The audio analysis could not be set up, not starting");
+      return;
+   }
+   DspBandsInit(&Dsp, NUM_BANDS, AUDIOIN_SAMPLING_FREQUENCY,
+                BANDS_MIN_FREQUENCY, BANDS_MAX_FREQUENCY, Bands, BandWeights);
+   Features.Spectrum = Dsp.Spectrum;
+   Features.Cumulative = SpectrumCumulative;
+   Features.NumBins = NUM_SAMPLES / 2;
+   Features.BinScale = 1.0f;
+   Features.Bands = BandEnergies;
+   Features.NumBands = NUM_BANDS;
+   Features.Beat = &BeatState;
+   DspStftInit(&Stft, StftHistory, NUM_SAMPLES);
+   if (AudioInInit(SampleBuffer, ArrayCount(SampleBuffer)) != 0)
+   {
+      LOG_ERR("The audio input could not be set up, not starting");
+      return;
+   }
+
+   StripOutput(Pixels, NumPixels);
+   Pixels = StripSwapBuffer(Pixels);
+
+   k_thread_create(&LoopThread, LoopStack, K_THREAD_STACK_SIZEOF(LoopStack),
+         EventLoop, NULL, NULL, NULL, LOOP_PRIORITY, 0, K_NO_WAIT);
+   k_thread_name_set(&LoopThread, "fl_loop");
+}
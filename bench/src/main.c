@@ -0,0 +1,243 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "fl_common.h"
+#include "fl_beat.h"
+#include "fl_dsp.h"
+#include "fl_lights.h"
+#include "fl_perf.h"
+
+#include <zephyr.h>
+#include <sys/printk.h>
+#include <math.h>
+
+#if defined(CONFIG_ARCH_POSIX)
+#include <time.h>
+#include "posix_board_if.h"
+#endif
+
+#define BENCH_SAMPLING_FREQUENCY (40000)
+#define BENCH_FRAME_RATE ((f32)BENCH_SAMPLING_FREQUENCY / (f32)CONFIG_FEELIGHTS_HOP_SIZE)
+#define BENCH_NUM_BANDS CONFIG_FEELIGHTS_NUM_BANDS
+#define BENCH_MAX_FFT_SIZE (4096)
+#define BENCH_MAX_PIXELS (5000)
+#define BANDS_MIN_FREQUENCY (40.0f)
+#define BANDS_MAX_FREQUENCY (10000.0f)
+/* The fastest of these runs is reported */
+#define BENCH_RUNS (5)
+/* Samples or pixels every run works through, at least BENCH_MIN_CALLS calls */
+#define BENCH_WORK (1 << 16)
+#define BENCH_MIN_CALLS (4)
+#define BENCH_SEED (0x2545F491)
+
+internal const u32 FftSizes[] = { 256, 512, 1024, 2048, 4096 };
+internal const u32 PixelCounts[] = { 100, 500, 1000, 2000, 5000 };
+internal const u32 OrbCounts[] = { 4, 16, 64, 256 };
+
+internal u16 Samples[BENCH_MAX_FFT_SIZE];
+internal u32 DspBuffer[DSP_BUFFER_SIZE(BENCH_MAX_FFT_SIZE) / sizeof(u32)];
+internal fl_dsp Dsp;
+internal fl_band Bands[BENCH_NUM_BANDS];
+internal f32 BandWeights[DSP_FILTERBANK_MAX_WEIGHTS(BENCH_MAX_FFT_SIZE, BENCH_NUM_BANDS)];
+internal f32 BandEnergies[BENCH_NUM_BANDS];
+internal fl_bin_sum Cumulative[BENCH_MAX_FFT_SIZE / 2 + 1];
+internal fl_beat BeatState;
+internal fl_audio_features Features;
+internal pixel Pixels[BENCH_MAX_PIXELS];
+internal u32 NumPixels;
+
+typedef struct {
+   const char *Name;
+   /* Untimed, puts back whatever the kernel consumed, calls are then timed
+    * one by one */
+   void (*Prepare)();
+   void (*Run)();
+} bench_kernel;
+
+#if defined(CONFIG_ARCH_POSIX)
+/* Simulated time stands still while code runs, so this is host time */
+#define BENCH_CLOCK "host"
+#define BENCH_TICKS_PER_SECOND (1000000000)
+#define BENCH_CYCLES(Ticks) (0)
+internal inline u32 BenchNow()
+{
+   struct timespec Now;
+
+   clock_gettime(CLOCK_MONOTONIC, &Now);
+   return (u32)((u64)Now.tv_sec * 1000000000 + Now.tv_nsec);
+}
+#elif defined(CONFIG_QEMU_TARGET)
+/* QEMU has no DWT, with icount the system timer follows the instructions */
+#define BENCH_CLOCK "icount"
+#define BENCH_TICKS_PER_SECOND sys_clock_hw_cycles_per_sec()
+#define BENCH_CYCLES(Ticks) (Ticks)
+internal inline u32 BenchNow()
+{
+   return k_cycle_get_32();
+}
+#else
+#define BENCH_CLOCK "cycles"
+#define BENCH_TICKS_PER_SECOND sys_clock_hw_cycles_per_sec()
+#define BENCH_CYCLES(Ticks) (Ticks)
+internal inline u32 BenchNow()
+{
+   return PerfBegin();
+}
+#endif
+
+/* The same inputs on every run and every target */
+internal u32 RandomState = BENCH_SEED;
+
+/* A bass line, a melody, a hi-hat and some noise around the ADC midpoint */
+internal void MakeSamples(u16 *Output, u32 NumSamples)
+{
+   const f32 TwoPi = 6.2831853f;
+
+   for (u32 I = 0; I < NumSamples; ++I)
+   {
+      f32 T = (f32)I / (f32)BENCH_SAMPLING_FREQUENCY;
+      f32 Value = 600.0f * sinf(TwoPi * 110.0f * T) +
+                  300.0f * sinf(TwoPi * 880.0f * T) +
+                  150.0f * sinf(TwoPi * 7040.0f * T) +
+                  (f32)(RandomNext(&RandomState) & 0xFF) - 128.0f;
+      Output[I] = (u16)(2048.0f + Value);
+   }
+}
+
+internal void SetUpDsp(u32 FftSize)
+{
+   DspInit(&Dsp, FftSize, DSP_WINDOW_HANN, DspBuffer);
+   DspBandsInit(&Dsp, BENCH_NUM_BANDS, BENCH_SAMPLING_FREQUENCY,
+                BANDS_MIN_FREQUENCY, BANDS_MAX_FREQUENCY, Bands, BandWeights);
+   DspNormalizeSamples(&Dsp, Samples);
+   DspCalculateSpectrum(&Dsp);
+   DspCalculateBands(&Dsp, BandEnergies);
+   DspCalculateCumulative(&Dsp, Cumulative);
+}
+
+internal void RunNormalize()
+{
+   DspNormalizeSamples(&Dsp, Samples);
+}
+
+/* The FFT works in place over the normalized samples */
+internal void RunSpectrum()
+{
+   DspCalculateSpectrum(&Dsp);
+}
+
+internal void RunBands()
+{
+   DspCalculateBands(&Dsp, BandEnergies);
+   DspCalculateCumulative(&Dsp, Cumulative);
+}
+
+internal void RunBeat()
+{
+   BeatUpdate(BandEnergies, &BeatState);
+}
+
+internal void RunRender()
+{
+   LightsUpdateAndRender(Pixels, NumPixels, &Features);
+}
+
+internal const bench_kernel Normalize = { "normalize", NULL, RunNormalize };
+internal const bench_kernel Spectrum = { "spectrum", RunNormalize, RunSpectrum };
+internal const bench_kernel BandsKernel = { "bands", NULL, RunBands };
+internal const bench_kernel Beat = { "beat", NULL, RunBeat };
+internal const bench_kernel Render = { "render", NULL, RunRender };
+
+/* One JSON object per line, Size is FFT points or pixels */
+internal void Measure(const bench_kernel *Kernel, u32 Size, u32 Orbs)
+{
+   u32 Calls = Maximum(BENCH_WORK / Size, BENCH_MIN_CALLS);
+   u32 Best = 0xFFFFFFFF;
+
+   if (Kernel->Prepare)
+   {
+      Kernel->Prepare();
+   }
+   Kernel->Run();
+
+   for (u32 Run = 0; Run < BENCH_RUNS; ++Run)
+   {
+      u32 Ticks = 0;
+
+      if (Kernel->Prepare)
+      {
+         for (u32 I = 0; I < Calls; ++I)
+         {
+            Kernel->Prepare();
+            u32 Start = BenchNow();
+            Kernel->Run();
+            Ticks += BenchNow() - Start;
+         }
+      }
+      else
+      {
+         u32 Start = BenchNow();
+         for (u32 I = 0; I < Calls; ++I)
+         {
+            Kernel->Run();
+         }
+         Ticks = BenchNow() - Start;
+      }
+      Best = Minimum(Best, Ticks);
+   }
+
+   u32 Ns = (u32)((u64)Best * 1000000000 / BENCH_TICKS_PER_SECOND / Calls);
+   u32 Cycles = BENCH_CYCLES(Best / Calls);
+
+   printk("{\"kernel\":\"%s\",\"size\":%u,\"orbs\":%u,\"calls\":%u,\"ns\":%u,\"cycles\":%u}\n",
+          Kernel->Name, Size, Orbs, Calls, Ns, Cycles);
+}
+
+void main(void)
+{
+   PerfInit();
+   MakeSamples(Samples, BENCH_MAX_FFT_SIZE);
+
+   printk("-----BEGIN FL BENCH-----\n");
+   printk("{\"board\":\"%s\",\"clock\":\"%s\",\"ticks_per_second\":%u}\n",
+          CONFIG_BOARD, BENCH_CLOCK, (u32)BENCH_TICKS_PER_SECOND);
+
+   for (u32 I = 0; I < ArrayCount(FftSizes); ++I)
+   {
+      SetUpDsp(FftSizes[I]);
+      Measure(&Normalize, FftSizes[I], 0);
+      Measure(&Spectrum, FftSizes[I], 0);
+      Measure(&BandsKernel, FftSizes[I], 0);
+   }
+
+   /* The lights see the analysis the application runs */
+   SetUpDsp(CONFIG_FEELIGHTS_FFT_SIZE);
+   BeatInit(BENCH_FRAME_RATE, BENCH_NUM_BANDS);
+   Measure(&Beat, BENCH_NUM_BANDS, 0);
+
+   Features.Spectrum = Dsp.Spectrum;
+   Features.Cumulative = Cumulative;
+   Features.NumBins = CONFIG_FEELIGHTS_FFT_SIZE / 2;
+   Features.BinScale = 1.0f;
+   Features.Bands = BandEnergies;
+   Features.NumBands = BENCH_NUM_BANDS;
+   Features.Beat = &BeatState;
+
+   LightsInit(BENCH_FRAME_RATE, BENCH_NUM_BANDS, BENCH_MAX_PIXELS, BENCH_SEED);
+   for (u32 I = 0; I < ArrayCount(PixelCounts); ++I)
+   {
+      for (u32 J = 0; J < ArrayCount(OrbCounts); ++J)
+      {
+         NumPixels = PixelCounts[I];
+         LightsSetLength(NumPixels);
+         Measure(&Render, NumPixels, LightsSetOrbCount(OrbCounts[J]));
+      }
+   }
+
+   printk("-----END FL BENCH-----\n");
+
+#if defined(CONFIG_ARCH_POSIX)
+   posix_exit(0);
+#endif
+}
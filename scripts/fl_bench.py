@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""Records the output of the bench application and compares recordings.
+
+    fl_bench.py record -o base.json -- ./build/zephyr/zephyr.exe
+    fl_bench.py record -o new.json --log qemu.log
+    fl_bench.py compare base.json new.json --threshold 5
+
+A recording holds the board, the clock the numbers came from, the commit
+it was built from and one entry per kernel and size. Comparing uses cycles
+where both recordings have them (targets and QEMU icount) and host
+nanoseconds otherwise, and fails if any kernel got slower than the
+threshold.
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+
+BEGIN = "-----BEGIN FL BENCH-----"
+END = "-----END FL BENCH-----"
+
+
+def parse(lines):
+    """Returns the header and results between the markers."""
+    inside = False
+    header = None
+    results = []
+    for line in lines:
+        line = line.strip()
+        if line.endswith(BEGIN):
+            inside = True
+            continue
+        if line.endswith(END):
+            break
+        if not inside or not line.startswith("{"):
+            continue
+        entry = json.loads(line)
+        if header is None:
+            header = entry
+        else:
+            results.append(entry)
+    if header is None:
+        raise ValueError("no bench output found")
+    return header, results
+
+
+def run(command):
+    """Runs the bench until it prints the end marker, QEMU never exits."""
+    lines = []
+    with subprocess.Popen(command, stdout=subprocess.PIPE, text=True,
+                          errors="replace") as process:
+        for line in process.stdout:
+            lines.append(line)
+            if END in line:
+                process.terminate()
+                break
+    return lines
+
+
+def commit():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], check=True,
+                              capture_output=True, text=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def key(entry):
+    return (entry["kernel"], entry["size"], entry["orbs"])
+
+
+def record(args):
+    if args.log:
+        with open(args.log, errors="replace") as log:
+            lines = log.readlines()
+    elif args.command:
+        lines = run(args.command)
+    else:
+        lines = sys.stdin.readlines()
+
+    header, results = parse(lines)
+    recording = dict(header, commit=commit(), results=results)
+    text = json.dumps(recording, indent=1)
+    if args.output:
+        with open(args.output, "w") as output:
+            output.write(text + "\n")
+    else:
+        print(text)
+    return 0
+
+
+def compare(args):
+    with open(args.base) as base_file, open(args.new) as new_file:
+        base = json.load(base_file)
+        new = json.load(new_file)
+
+    if base["clock"] != new["clock"] or base["board"] != new["board"]:
+        print(f"warning: comparing {base['board']}/{base['clock']} "
+              f"with {new['board']}/{new['clock']}", file=sys.stderr)
+
+    old = {key(entry): entry for entry in base["results"]}
+    regressions = 0
+    print(f"{'kernel':10} {'size':>6} {'orbs':>4} {'unit':>6} {'base':>10} {'new':>10} {'change':>8}")
+    for entry in new["results"]:
+        previous = old.get(key(entry))
+        if previous is None:
+            continue
+        unit = "cycles" if entry["cycles"] and previous["cycles"] else "ns"
+        before, after = previous[unit], entry[unit]
+        change = 100.0 * (after - before) / before if before else 0.0
+        flag = ""
+        if change > args.threshold:
+            regressions += 1
+            flag = "  <- slower"
+        print(f"{entry['kernel']:10} {entry['size']:6} {entry['orbs']:4} {unit:>6} "
+              f"{before:10} {after:10} {change:+7.1f}%{flag}")
+
+    print(f"{regressions} regressions over {args.threshold}% "
+          f"({base.get('commit')} -> {new.get('commit')})")
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="action", required=True)
+
+    record_parser = commands.add_parser("record", help="store the output of one bench run")
+    record_parser.add_argument("-o", "--output", help="JSON file, stdout by default")
+    record_parser.add_argument("--log", help="captured console output instead of running the bench")
+    record_parser.add_argument("command", nargs=argparse.REMAINDER,
+                               help="bench to run after --, stdin is read without one")
+
+    compare_parser = commands.add_parser("compare", help="compare two recordings")
+    compare_parser.add_argument("base")
+    compare_parser.add_argument("new")
+    compare_parser.add_argument("--threshold", type=float, default=5.0,
+                                help="percent a kernel may get slower, 5 by default")
+
+    args = parser.parse_args()
+    if args.action == "record":
+        if args.command and args.command[0] == "--":
+            args.command = args.command[1:]
+        return record(args)
+    return compare(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
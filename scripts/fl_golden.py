@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""Golden output regression check for the DSP and lights code.
+
+Plays an audio file through the native_posix build of the application with
+fixed seeds and compares the frames it pushes to the strip with a stored
+golden capture:
+
+    fl_golden.py record track.golden --exe build/zephyr/zephyr.exe --audio track.wav
+    fl_golden.py check track.golden --exe build/zephyr/zephyr.exe --audio track.wav
+    fl_golden.py hashes track.golden
+
+A golden file is the gzip compressed strip capture (see
+CONFIG_FEELIGHTS_STRIP_FILE). A capture can also be given directly with
+--frames instead of running the program. Frames are hashed the same way as
+the checksums in `fl trace`, so they can be matched against the hardware.
+"""
+
+import argparse
+import atexit
+import gzip
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+FRAME_HEADER = struct.Struct("<II")
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+
+
+def read_frames(path):
+    """Yields (uptime_us, pixels) with pixels as r, g, b bytes."""
+    opener = gzip.open if path.endswith(".gz") or path.endswith(".golden") else open
+    with opener(path, "rb") as stream:
+        while True:
+            header = stream.read(FRAME_HEADER.size)
+            if len(header) < FRAME_HEADER.size:
+                return
+            uptime, count = FRAME_HEADER.unpack(header)
+            pixels = stream.read(3 * count)
+            if len(pixels) < 3 * count:
+                raise ValueError(f"{path}: frame at {uptime} us is cut short")
+            yield uptime, pixels
+
+
+def frame_hash(pixels):
+    """FNV-1a over the pixels as 32 bit words, like fl_trace.c."""
+    value = FNV_OFFSET
+    for i in range(0, len(pixels), 3):
+        word = pixels[i] | (pixels[i + 1] << 8) | (pixels[i + 2] << 16)
+        value = ((value ^ word) * FNV_PRIME) & 0xFFFFFFFF
+    return value
+
+
+def capture(args):
+    """Returns the path of the frames to check, running the program if needed.
+    The capture is removed at exit if it was made here."""
+    if args.frames:
+        return args.frames
+    if not args.exe or not args.audio:
+        sys.exit("either --frames or both --exe and --audio are needed")
+    handle, path = tempfile.mkstemp(suffix=".bin")
+    os.close(handle)
+    atexit.register(os.remove, path)
+    command = [args.exe, f"--audio={args.audio}", f"--strip-out={path}",
+               f"--seed={args.seed}", "--no-rt"]
+    subprocess.run(command, check=True, stdout=subprocess.DEVNULL)
+    return path
+
+
+def record(args):
+    path = capture(args)
+    frames = sum(1 for _ in read_frames(path))
+    with open(path, "rb") as source, gzip.open(args.golden, "wb") as golden:
+        golden.write(source.read())
+    print(f"{args.golden}: {frames} frames")
+    return 0
+
+
+def check(args):
+    path = capture(args)
+    golden = list(read_frames(args.golden))
+    frames = list(read_frames(path))
+    failed = 0
+    first = None
+    worst = (0, None)
+
+    if len(frames) != len(golden):
+        print(f"frame count changed: {len(golden)} golden, {len(frames)} now")
+        failed += 1
+
+    for index, ((_, expected), (_, actual)) in enumerate(zip(golden, frames)):
+        if expected == actual:
+            continue
+        if len(expected) != len(actual):
+            print(f"frame {index}: {len(expected) // 3} pixels golden, {len(actual) // 3} now")
+            failed += 1
+            continue
+        # Worst channel difference and the share of pixels over the tolerance
+        differences = [abs(a - b) for a, b in zip(expected, actual)]
+        largest = max(differences)
+        over = sum(1 for i in range(0, len(differences), 3)
+                   if max(differences[i:i + 3]) > args.tolerance)
+        share = 100.0 * over / (len(expected) // 3)
+        if largest > worst[0]:
+            worst = (largest, index)
+        if share > args.max_pixels:
+            failed += 1
+            if first is None:
+                first = index
+                print(f"frame {index}: {over} pixels ({share:.1f}%) differ by more than "
+                      f"{args.tolerance}, up to {largest} "
+                      f"({frame_hash(expected):08x} golden, {frame_hash(actual):08x} now)")
+
+    if worst[1] is not None:
+        print(f"largest difference {worst[0]} in frame {worst[1]}")
+    print(f"{len(frames)} frames, {failed} failing")
+    return 1 if failed else 0
+
+
+def hashes(args):
+    for index, (uptime, pixels) in enumerate(read_frames(args.frames)):
+        print(f"{index} {uptime} {len(pixels) // 3} {frame_hash(pixels):08x}")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="action", required=True)
+
+    def add_source(command):
+        command.add_argument("--exe", help="native_posix build of the application")
+        command.add_argument("--audio", help="audio file played into it")
+        command.add_argument("--seed", type=int, default=1,
+                             help="seed of the native random generator, 1 by default")
+        command.add_argument("--frames", help="strip capture to use instead of running --exe")
+
+    record_parser = commands.add_parser("record", help="store a new golden capture")
+    record_parser.add_argument("golden")
+    add_source(record_parser)
+
+    check_parser = commands.add_parser("check", help="compare against a golden capture")
+    check_parser.add_argument("golden")
+    add_source(check_parser)
+    check_parser.add_argument("--tolerance", type=int, default=0,
+                              help="channel difference a pixel may have, 0 by default")
+    check_parser.add_argument("--max-pixels", type=float, default=0.0,
+                              help="percent of pixels per frame allowed over the tolerance")
+
+    hashes_parser = commands.add_parser("hashes", help="list the frame hashes of a capture")
+    hashes_parser.add_argument("frames")
+
+    args = parser.parse_args()
+    return {"record": record, "check": check, "hashes": hashes}[args.action](args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""Reports where the large symbols of a FeeLights image were placed.
+
+Prints the use of every memory of the STM32F429 and the symbols above a size
+threshold in each, then fails if one of the buffers handed to a DMA stream
+ended up in CCM, which the DMA controllers can not reach.
+"""
+
+import argparse
+import sys
+
+from elftools.elf.elffile import ELFFile
+from elftools.elf.sections import SymbolTableSection
+
+# Name, start, size
+REGIONS = [
+    ("FLASH", 0x08000000, 2 * 1024 * 1024),
+    ("CCM", 0x10000000, 64 * 1024),
+    ("SRAM", 0x20000000, 192 * 1024),
+    ("SDRAM", 0xD0000000, 8 * 1024 * 1024),
+]
+
+# Read or written by a DMA stream, see fl_audioin.c and the strip backends
+DMA_BUFFERS = {"SampleBuffer", "PixelArena", "EncodeBuffer", "Ring", "Wave", "AllLines"}
+
+
+def region_of(address):
+    for name, start, size in REGIONS:
+        if start <= address < start + size:
+            return name
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("elf", help="zephyr.elf of the build")
+    parser.add_argument("--threshold", type=int, default=256,
+                        help="list symbols of at least this many bytes")
+    args = parser.parse_args()
+
+    with open(args.elf, "rb") as f:
+        elf = ELFFile(f)
+        symbols = []
+        for section in elf.iter_sections():
+            if not isinstance(section, SymbolTableSection):
+                continue
+            for symbol in section.iter_symbols():
+                if symbol["st_info"]["type"] != "STT_OBJECT" or symbol["st_size"] == 0:
+                    continue
+                symbols.append((symbol.name, symbol["st_value"], symbol["st_size"]))
+
+    used = {name: 0 for name, _, _ in REGIONS}
+    errors = []
+    for name, address, size in symbols:
+        region = region_of(address)
+        if region is None:
+            continue
+        used[region] += size
+        if region == "CCM" and name in DMA_BUFFERS:
+            errors.append(name)
+
+    for region, start, size in REGIONS:
+        print(f"{region:6} {used[region]:8} of {size:8} bytes ({100.0 * used[region] / size:5.1f}%)")
+        placed = [s for s in symbols if region_of(s[1]) == region and s[2] >= args.threshold]
+        for name, address, symbol_size in sorted(placed, key=lambda s: -s[2]):
+            print(f"       0x{address:08x} {symbol_size:8} {name}")
+
+    for name in errors:
+        print(f"error: DMA buffer {name} is in CCM", file=sys.stderr)
+
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
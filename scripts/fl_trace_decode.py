@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+"""Decodes a frame trace dumped with `fl trace dump` into CSV or JSON.
+
+Feed it a capture of the shell UART. Everything outside the BEGIN and END
+markers is ignored, so the whole session log can be passed in.
+"""
+
+import argparse
+import base64
+import binascii
+import csv
+import json
+import re
+import struct
+import sys
+
+BEGIN = "-----BEGIN FL TRACE-----"
+END = "-----END FL TRACE-----"
+# Prompts and colours the shell may mix into the captured lines
+NOISE = re.compile(r"\x1b\[[0-9;]*[A-Za-z]|^.*?:~\$ ")
+
+HEADER = struct.Struct("<4sBBBBHHI")
+# Matches TRACE_STAGES in fl_trace.h for version 1
+STAGE_NAMES = ["stft", "normalize", "fft", "bands", "beat", "render", "frame"]
+# Matches the fixed point units in fl_trace_record
+BAND_OFFSET = 160.0
+
+
+def read_chunks(stream):
+    chunks = None
+    for line in stream:
+        line = NOISE.sub("", line).strip()
+        if line == BEGIN:
+            chunks = []
+        elif line == END and chunks is not None:
+            return chunks
+        elif chunks is not None and line:
+            try:
+                chunks.append(base64.b64decode(line, validate=True))
+            except binascii.Error:
+                print(f"warning: skipping garbled line {line!r}", file=sys.stderr)
+    raise SystemExit("error: no complete trace found in the input")
+
+
+def record_struct(num_stages, num_bands, max_orbs):
+    return struct.Struct("<II" + "I" * num_stages + "HHIHBB" + "HBB" * max_orbs + "B" * num_bands)
+
+
+def decode(chunks):
+    magic, version, num_stages, num_bands, max_orbs, record_size, num_records, cycles_per_second = \
+        HEADER.unpack(chunks[0][:HEADER.size])
+    if magic != b"FLTR" or version != 1:
+        raise SystemExit(f"error: unsupported trace {magic!r} version {version}")
+
+    layout = record_struct(num_stages, num_bands, max_orbs)
+    if layout.size != record_size:
+        raise SystemExit(f"error: records are {record_size} bytes, expected {layout.size}")
+    if len(chunks) - 1 != num_records:
+        print(f"warning: {len(chunks) - 1} of {num_records} records present", file=sys.stderr)
+
+    stage_names = STAGE_NAMES if num_stages == len(STAGE_NAMES) else \
+        [f"stage{i}" for i in range(num_stages)]
+    us_per_cycle = 1e6 / cycles_per_second
+    records = []
+    for chunk in chunks[1:]:
+        if len(chunk) != record_size:
+            print("warning: skipping a truncated record", file=sys.stderr)
+            continue
+        values = list(layout.unpack(chunk))
+        sequence, timestamp = values[0:2]
+        stages = values[2:2 + num_stages]
+        rms, peak, checksum, num_pixels, ambient, num_orbs = values[2 + num_stages:8 + num_stages]
+        orb_values = values[8 + num_stages:8 + num_stages + 3 * max_orbs]
+        bands = values[8 + num_stages + 3 * max_orbs:]
+        records.append({
+            "sequence": sequence,
+            "timestamp_us": round(timestamp * us_per_cycle, 1),
+            "stages_us": {name: round(cycles * us_per_cycle, 1) for name, cycles in zip(stage_names, stages)},
+            "rms": rms,
+            "peak": peak,
+            "checksum": f"{checksum:08x}",
+            "num_pixels": num_pixels,
+            "ambient": ambient,
+            "orbs": [{"p": orb_values[3 * i] / 8.0,
+                      "r": orb_values[3 * i + 1] / 16.0,
+                      "intensity": orb_values[3 * i + 2]} for i in range(min(num_orbs, max_orbs))],
+            # Eighths of an octave, 0 is silence
+            "bands_log2": [round((b - BAND_OFFSET) / 8.0, 3) if b else None for b in bands],
+        })
+    return records, stage_names, max_orbs, num_bands
+
+
+def write_csv(records, stage_names, max_orbs, num_bands, out):
+    columns = ["sequence", "timestamp_us"] + [f"{name}_us" for name in stage_names] + \
+        ["rms", "peak", "checksum", "num_pixels", "ambient"] + \
+        [f"orb{i}_{field}" for i in range(max_orbs) for field in ("p", "r", "intensity")] + \
+        [f"band{i}_log2" for i in range(num_bands)]
+    writer = csv.writer(out)
+    writer.writerow(columns)
+    for record in records:
+        row = [record["sequence"], record["timestamp_us"]] + list(record["stages_us"].values()) + \
+            [record["rms"], record["peak"], record["checksum"], record["num_pixels"], record["ambient"]]
+        for i in range(max_orbs):
+            orb = record["orbs"][i] if i < len(record["orbs"]) else {}
+            row += [orb.get("p", ""), orb.get("r", ""), orb.get("intensity", "")]
+        row += ["" if b is None else b for b in record["bands_log2"]]
+        writer.writerow(row)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("log", nargs="?", help="captured shell output, stdin if left out")
+    parser.add_argument("--json", action="store_true", help="write JSON instead of CSV")
+    parser.add_argument("-o", "--output", help="output file, stdout if left out")
+    args = parser.parse_args()
+
+    with (open(args.log, errors="replace") if args.log else sys.stdin) as stream:
+        chunks = read_chunks(stream)
+    records, stage_names, max_orbs, num_bands = decode(chunks)
+
+    with (open(args.output, "w", newline="") if args.output else sys.stdout) as out:
+        if args.json:
+            json.dump(records, out, indent=1)
+            out.write("\n")
+        else:
+            write_csv(records, stage_names, max_orbs, num_bands, out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
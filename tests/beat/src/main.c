@@ -0,0 +1,120 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ztest.h>
+#include "fl_common.h"
+#include "fl_beat.h"
+
+#define TEST_FRAME_RATE (40000.0f / 256.0f)
+#define TEST_NUM_BANDS (32)
+#define TEST_SECONDS (30)
+/* Only the beats after this have to be locked on */
+#define TEST_SETTLE_SECONDS (15)
+#define TEST_BPM_TOLERANCE (2.0f)
+/* A beat may come this many frames off a click, about 20 ms. The tracker
+ * sees a peak one onset tick late */
+#define TEST_BEAT_FRAMES (3)
+
+typedef struct {
+   u32 Beats;
+   u32 BeatsOnClick;
+   f32 Bpm;
+   f32 Confidence;
+} click_result;
+
+/* A click in every band on each beat over a little noise, the clicks fall
+ * between frames so their spacing jitters by a frame */
+internal void RunClickTrain(f32 Bpm, click_result *Result)
+{
+   f32 Bands[TEST_NUM_BANDS];
+   fl_beat Beat = {0};
+   u32 Seed = 1;
+   f32 Interval = 60.0f / Bpm;
+   f32 NextClick = 1.0f;
+   i32 LastClick = -1000;
+   i32 PendingBeat = -1;
+
+   memset(Result, 0, sizeof(*Result));
+   zassert_equal(BeatInit(TEST_FRAME_RATE, TEST_NUM_BANDS), 0, "BeatInit failed");
+
+   for (i32 Frame = 0; Frame < (i32)(TEST_SECONDS * TEST_FRAME_RATE); ++Frame)
+   {
+      f32 Time = (f32)Frame / TEST_FRAME_RATE;
+      bool Click = Time >= NextClick;
+
+      if (Click)
+      {
+         NextClick += Interval;
+         LastClick = Frame;
+      }
+      for (u32 I = 0; I < TEST_NUM_BANDS; ++I)
+      {
+         Bands[I] = 0.001f + 0.0005f * RandomUnit(&Seed) + (Click ? 0.2f : 0.0f);
+      }
+
+      BeatUpdate(Bands, &Beat);
+
+      if (Time < TEST_SETTLE_SECONDS)
+      {
+         continue;
+      }
+      /* A beat just before its click is matched once the click comes */
+      if (Beat.Beat)
+      {
+         Result->Beats++;
+         if (Frame - LastClick <= TEST_BEAT_FRAMES)
+         {
+            Result->BeatsOnClick++;
+         }
+         else
+         {
+            PendingBeat = Frame;
+         }
+      }
+      if (Click && PendingBeat >= 0)
+      {
+         if (Frame - PendingBeat <= TEST_BEAT_FRAMES)
+         {
+            Result->BeatsOnClick++;
+         }
+         PendingBeat = -1;
+      }
+   }
+
+   Result->Bpm = Beat.Bpm;
+   Result->Confidence = Beat.Confidence;
+}
+
+internal void CheckLock(f32 Bpm)
+{
+   click_result Result;
+   u32 Expected = (u32)((TEST_SECONDS - TEST_SETTLE_SECONDS) * Bpm / 60.0f);
+
+   RunClickTrain(Bpm, &Result);
+
+   zassert_within(Result.Bpm, Bpm, TEST_BPM_TOLERANCE, "tempo %f, clicks at %f", Result.Bpm, Bpm);
+   zassert_true(Result.Confidence > 0.5f, "confidence %f", Result.Confidence);
+   zassert_within(Result.Beats, Expected, 1, "%u beats for %u clicks", Result.Beats, Expected);
+   zassert_equal(Result.BeatsOnClick, Result.Beats, "%u of %u beats on a click",
+                 Result.BeatsOnClick, Result.Beats);
+}
+
+static void test_click_train_120(void)
+{
+   CheckLock(120.0f);
+}
+
+/* Away from the centre of the tempo prior */
+static void test_click_train_96(void)
+{
+   CheckLock(96.0f);
+}
+
+void test_main(void)
+{
+   ztest_test_suite(beat,
+                    ztest_unit_test(test_click_train_120),
+                    ztest_unit_test(test_click_train_96));
+   ztest_run_test_suite(beat);
+}
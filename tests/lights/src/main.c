@@ -0,0 +1,274 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ztest.h>
+#include <math.h>
+#include <string.h>
+#include "fl_common.h"
+#include "fl_beat.h"
+#include "fl_dsp.h"
+#include "fl_lights.h"
+
+#define TEST_FRAME_RATE (40000.0f / 256.0f)
+#define TEST_NUM_BANDS (32)
+#define TEST_NUM_BINS (512)
+#define TEST_MAX_PIXELS (5000)
+#define TEST_FRAMES (600)
+#define TEST_SEED (42)
+#define TEST_BEAT_HOPS (12)
+/* Same as PIXEL_MAX_CHANNEL in fl_lights.c and FILL_MAX_SUM in fl_compose.c */
+#define TEST_MAX_CHANNEL (250)
+#define TEST_FILL_MAX_SUM (50)
+/* What CONFIG_FEELIGHTS_LIGHTS_Q8 promises against the float renderer */
+#define TEST_Q8_MAX_ERROR (1)
+
+typedef struct {
+   u32 Channels;
+   u32 Differ;
+   u32 MaxError;
+} compare_result;
+
+static pixel Frame[TEST_MAX_PIXELS];
+static pixel Previous[TEST_MAX_PIXELS];
+static pixel Reference[TEST_MAX_PIXELS];
+/* Channel sum of the orbs alone, before the ambient fills in */
+static u32 OrbSums[TEST_MAX_PIXELS];
+static fl_orb_state Orbs[CONFIG_FEELIGHTS_MAX_ORBS];
+
+static f32 Bands[TEST_NUM_BANDS];
+static fl_bin_sum Cumulative[TEST_NUM_BINS + 1];
+static fl_beat Beat;
+static fl_audio_features Features = {
+   .Cumulative = Cumulative,
+   .NumBins = TEST_NUM_BINS,
+   .BinScale = 1.0f,
+   .Bands = Bands,
+   .NumBands = TEST_NUM_BANDS,
+   .Beat = &Beat,
+};
+
+/* Louder and quieter stretches of noise, so orbs both saturate and fade,
+ * with a confident beat every TEST_BEAT_HOPS */
+static void NextFeatures(u32 *Seed, u32 Hop)
+{
+   f32 Level = 0.04f * (f32)((Hop / 40) % 3);
+   fl_bin_sum Sum = 0;
+
+   Beat.Beat = (Hop % TEST_BEAT_HOPS) == 0;
+   Beat.BeatInBar = (Hop / TEST_BEAT_HOPS) % 4;
+   Beat.Downbeat = Beat.Beat && Beat.BeatInBar == 0;
+   Beat.Confidence = 1.0f;
+
+   for (u32 I = 0; I < TEST_NUM_BANDS; ++I)
+   {
+      Bands[I] = Level * RandomUnit(Seed);
+   }
+   Cumulative[0] = 0;
+   for (u32 I = 0; I < TEST_NUM_BINS; ++I)
+   {
+      Sum += DSP_BIN_FROM_F32(0.01f * Level * RandomUnit(Seed));
+      Cumulative[I + 1] = Sum;
+   }
+}
+
+/* Every orb over every pixel with the float math of the renderer, then the
+ * ambient where the orbs left the strip dark */
+static void RenderReference(u32 NumPixels, bool Ambient)
+{
+   u32 NumOrbs = LightsGetOrbs(Orbs, CONFIG_FEELIGHTS_MAX_ORBS);
+   fl_color AmbientColor = LightsGetAmbientColor();
+   f32 AmbientIntensity = LightsGetAmbientIntensity();
+   u32 AmbientR = Minimum((u32)(AmbientColor.R * AmbientIntensity), 0xFF);
+   u32 AmbientG = Minimum((u32)(AmbientColor.G * AmbientIntensity), 0xFF);
+   u32 AmbientB = Minimum((u32)(AmbientColor.B * AmbientIntensity), 0xFF);
+
+   memset(Reference, 0, NumPixels * sizeof(pixel));
+   for (u32 Orb = 0; Orb < NumOrbs; ++Orb)
+   {
+      fl_orb_state *State = &Orbs[Orb];
+      i32 I = Maximum((i32)ceil(State->P - State->R), 0);
+      i32 MaxI = Minimum((i32)floor(State->P + State->R), (i32)NumPixels);
+      f32 P = (f32)I;
+
+      for ( ; I < MaxI; ++I, P += 1.0f)
+      {
+         struct led_rgb *Color = &Reference[I].Color;
+         f32 Rate = 1.0f - (Square(P - State->P) - Square(State->R));
+         f32 Intensity = Rate * State->Intensity;
+         Color->r = ClampU(0, Color->r + (u32)(State->Color.R * Intensity), TEST_MAX_CHANNEL);
+         Color->g = ClampU(0, Color->g + (u32)(State->Color.G * Intensity), TEST_MAX_CHANNEL);
+         Color->b = ClampU(0, Color->b + (u32)(State->Color.B * Intensity), TEST_MAX_CHANNEL);
+      }
+   }
+
+   for (u32 I = 0; I < NumPixels; ++I)
+   {
+      struct led_rgb *Color = &Reference[I].Color;
+
+      OrbSums[I] = Color->r + Color->g + Color->b;
+      if (Ambient && OrbSums[I] < TEST_FILL_MAX_SUM)
+      {
+         Color->r = Minimum(Color->r + AmbientR, TEST_MAX_CHANNEL);
+         Color->g = Minimum(Color->g + AmbientG, TEST_MAX_CHANNEL);
+         Color->b = Minimum(Color->b + AmbientB, TEST_MAX_CHANNEL);
+      }
+   }
+}
+
+static void CompareChannel(compare_result *Result, u32 A, u32 B)
+{
+   u32 Error = A > B ? A - B : B - A;
+
+   Result->Channels++;
+   Result->Differ += Error != 0;
+   Result->MaxError = Maximum(Result->MaxError, Error);
+}
+
+/* The q8 orbs may land a step either side of the ambient threshold, those
+ * pixels are left out */
+static void CompareFrame(compare_result *Result, u32 NumPixels)
+{
+   for (u32 I = 0; I < NumPixels; ++I)
+   {
+      if (IS_ENABLED(CONFIG_FEELIGHTS_LIGHTS_Q8) &&
+          OrbSums[I] + 3 * TEST_Q8_MAX_ERROR >= TEST_FILL_MAX_SUM &&
+          OrbSums[I] < TEST_FILL_MAX_SUM + 3 * TEST_Q8_MAX_ERROR)
+      {
+         continue;
+      }
+      CompareChannel(Result, Frame[I].Color.r, Reference[I].Color.r);
+      CompareChannel(Result, Frame[I].Color.g, Reference[I].Color.g);
+      CompareChannel(Result, Frame[I].Color.b, Reference[I].Color.b);
+   }
+}
+
+static void CheckAgainstReference(u32 NumPixels, u32 NumOrbs, bool Ambient)
+{
+   compare_result Result = {0};
+   u32 Seed = 7;
+
+   LightsInit(TEST_FRAME_RATE, TEST_NUM_BANDS, NumPixels, TEST_SEED);
+   LightsSetOrbCount(NumOrbs);
+   LightsSetAmbient(Ambient);
+
+   for (u32 Hop = 0; Hop < TEST_FRAMES; ++Hop)
+   {
+      NextFeatures(&Seed, Hop);
+      LightsUpdateAndRender(Frame, NumPixels, &Features);
+      RenderReference(NumPixels, Ambient);
+      CompareFrame(&Result, NumPixels);
+   }
+
+   if (IS_ENABLED(CONFIG_FEELIGHTS_LIGHTS_Q8))
+   {
+      zassert_true(Result.MaxError <= TEST_Q8_MAX_ERROR, "%u pixels, %u orbs: off by %u",
+                   NumPixels, NumOrbs, Result.MaxError);
+   }
+   else
+   {
+      zassert_equal(Result.Differ, 0, "%u pixels, %u orbs: %u of %u channels differ",
+                    NumPixels, NumOrbs, Result.Differ, Result.Channels);
+   }
+}
+
+/* The binned, composed frames against every orb drawn over every pixel,
+ * with the flash at an opacity of 0 */
+static void test_render_matches_reference(void)
+{
+   CheckAgainstReference(123, 4, true);
+   CheckAgainstReference(600, 16, true);
+   CheckAgainstReference(600, 64, false);
+   CheckAgainstReference(TEST_MAX_PIXELS, 64, true);
+}
+
+/* A frame rendered right after an update with a blend of 0 is the frame
+ * before it, unless the update placed the orbs again */
+static void test_blend_starts_at_previous_frame(void)
+{
+   const u32 NumPixels = 600;
+   u32 Seed = 7;
+   u32 Checked = 0;
+
+   LightsInit(TEST_FRAME_RATE, TEST_NUM_BANDS, NumPixels, TEST_SEED);
+   for (u32 Hop = 0; Hop < TEST_FRAMES; ++Hop)
+   {
+      f32 FirstP;
+
+      NextFeatures(&Seed, Hop);
+      LightsGetOrbs(Orbs, 1);
+      FirstP = Orbs[0].P;
+      memcpy(Previous, Frame, sizeof(Previous));
+
+      LightsUpdate(&Features);
+      LightsRender(Frame, NumPixels, 0.0f);
+      LightsGetOrbs(Orbs, 1);
+      if (Hop > 0 && Orbs[0].P == FirstP)
+      {
+         zassert_mem_equal(Frame, Previous, NumPixels * sizeof(pixel), "hop %u", Hop);
+         Checked++;
+      }
+      LightsRender(Frame, NumPixels, 1.0f);
+   }
+
+   zassert_true(Checked > TEST_FRAMES / 2, "only %u hops checked", Checked);
+}
+
+/* Dropping orbs keeps the ones that stay where they are */
+static void test_orb_count_keeps_orbs(void)
+{
+   static fl_orb_state Before[CONFIG_FEELIGHTS_MAX_ORBS];
+   const u32 Half = CONFIG_FEELIGHTS_MAX_ORBS / 2;
+
+   LightsInit(TEST_FRAME_RATE, TEST_NUM_BANDS, 600, TEST_SEED);
+   LightsSetOrbCount(CONFIG_FEELIGHTS_MAX_ORBS);
+   LightsGetOrbs(Before, CONFIG_FEELIGHTS_MAX_ORBS);
+
+   zassert_equal(LightsSetOrbCount(Half), Half, NULL);
+   zassert_equal(LightsSetOrbCount(CONFIG_FEELIGHTS_MAX_ORBS), CONFIG_FEELIGHTS_MAX_ORBS, NULL);
+   LightsGetOrbs(Orbs, CONFIG_FEELIGHTS_MAX_ORBS);
+   for (u32 I = 0; I < Half; ++I)
+   {
+      zassert_true(Orbs[I].P == Before[I].P && Orbs[I].R == Before[I].R, "orb %u moved", I);
+   }
+}
+
+/* The packed helpers against the same math on every lane on its own */
+static void test_packed_ops(void)
+{
+   for (u32 A = 0; A < 256; ++A)
+   {
+      for (u32 B = 0; B < 256; ++B)
+      {
+         u32 PackedA = A | (B << 8) | (A << 16) | ((255 - B) << 24);
+         u32 PackedB = B | (A << 8) | ((255 - A) << 16) | (B << 24);
+         u32 Multiplied = PackedMultiply(PackedA, PackedB);
+         u32 Scaled = PackedScale(PackedA, B + (B >> 7));
+
+         for (u32 Shift = 0; Shift < 32; Shift += 8)
+         {
+            u32 LaneA = (PackedA >> Shift) & 0xFF;
+            u32 LaneB = (PackedB >> Shift) & 0xFF;
+
+            zassert_equal((Multiplied >> Shift) & 0xFF, LaneA * (LaneB + 1) >> 8,
+                          "multiply %u by %u", LaneA, LaneB);
+            zassert_equal((Scaled >> Shift) & 0xFF, LaneA * (B + (B >> 7)) >> 8,
+                          "scale %u by %u", LaneA, B + (B >> 7));
+         }
+         zassert_equal(PackedMaximum(PackedA, PackedB) & 0xFF, Maximum(A, B), NULL);
+         zassert_equal(PackedMinimum(PackedA, PackedB) & 0xFF, Minimum(A, B), NULL);
+      }
+      zassert_equal(PackedMultiply(A * 0x01010101, 0xFFFFFFFF), A * 0x01010101, NULL);
+      zassert_equal(PackedScale(A * 0x01010101, 256), A * 0x01010101, NULL);
+   }
+}
+
+void test_main(void)
+{
+   ztest_test_suite(lights,
+                    ztest_unit_test(test_render_matches_reference),
+                    ztest_unit_test(test_blend_starts_at_previous_frame),
+                    ztest_unit_test(test_orb_count_keeps_orbs),
+                    ztest_unit_test(test_packed_ops));
+   ztest_run_test_suite(lights);
+}
@@ -0,0 +1,117 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ztest.h>
+#include <string.h>
+#include "fl_common.h"
+#include "fl_strip_spi.h"
+
+#define TEST_MAX_PIXELS (64)
+#define TEST_CHUNK_PIXELS (8)
+
+static pixel Pixels[TEST_MAX_PIXELS];
+static u8 Expected[TEST_MAX_PIXELS * STRIP_BYTES_PER_PIXEL];
+/* Whole chunks, so the zero filled end of the last one fits as well */
+static u8 Chunked[(TEST_MAX_PIXELS + TEST_CHUNK_PIXELS) * STRIP_BYTES_PER_PIXEL];
+
+/* The WS2812 bits most significant first, each as 100 or 110 on the wire */
+static u8 *ReferenceByte(u8 *Out, u8 Value)
+{
+   u32 Bits = 0;
+
+   for (i32 Bit = 7; Bit >= 0; --Bit)
+   {
+      Bits = (Bits << 3) | (((Value >> Bit) & 1) ? 0x6 : 0x4);
+   }
+   Out[0] = (u8)(Bits >> 16);
+   Out[1] = (u8)(Bits >> 8);
+   Out[2] = (u8)Bits;
+
+   return Out + 3;
+}
+
+static void FillPixels(u32 *Seed)
+{
+   for (u32 I = 0; I < TEST_MAX_PIXELS; ++I)
+   {
+      Pixels[I].Color.r = (u8)RandomNext(Seed);
+      Pixels[I].Color.g = (u8)RandomNext(Seed);
+      Pixels[I].Color.b = (u8)RandomNext(Seed);
+   }
+}
+
+/* Every byte value through the lookup table against the bit by bit encoding */
+static void test_encode_byte(void)
+{
+   for (u32 Value = 0; Value < 256; ++Value)
+   {
+      u8 Out[3];
+      u8 Reference[3];
+
+      zassert_equal(EncodeByte(Out, (u8)Value), Out + 3, NULL);
+      ReferenceByte(Reference, (u8)Value);
+      zassert_mem_equal(Out, Reference, sizeof(Out), "byte 0x%02X", Value);
+   }
+}
+
+static void test_encode_pixel_order(void)
+{
+   pixel Pixel = { .Color = { .r = 0x12, .g = 0x34, .b = 0x56 } };
+   u8 Out[STRIP_BYTES_PER_PIXEL];
+   u8 Reference[STRIP_BYTES_PER_PIXEL];
+   u8 *End = ReferenceByte(Reference, 0x34);
+
+   End = ReferenceByte(End, 0x12);
+   ReferenceByte(End, 0x56);
+
+   zassert_equal(EncodePixel(Out, &Pixel), Out + sizeof(Out), NULL);
+   zassert_mem_equal(Out, Reference, sizeof(Out), NULL);
+}
+
+/* Chunk after chunk, as the streaming backend refills its ring, gives the
+ * whole-frame encoding followed by zeros */
+static void test_chunks_match_frame(void)
+{
+   u32 Seed = 7;
+
+   FillPixels(&Seed);
+   for (u32 NumPixels = 0; NumPixels <= TEST_MAX_PIXELS; ++NumPixels)
+   {
+      u8 *Out = Expected;
+      u32 Next = 0;
+      u32 Count;
+      u32 Chunks = 0;
+
+      for (u32 I = 0; I < NumPixels; ++I)
+      {
+         Out = EncodePixel(Out, &Pixels[I]);
+      }
+
+      memset(Chunked, 0xFF, sizeof(Chunked));
+      do
+      {
+         Count = EncodeChunk(Chunked + Chunks * TEST_CHUNK_PIXELS * STRIP_BYTES_PER_PIXEL,
+                             Pixels + Next, NumPixels - Next, TEST_CHUNK_PIXELS);
+         Next += Count;
+         Chunks++;
+      } while (Count == TEST_CHUNK_PIXELS);
+
+      zassert_equal(Next, NumPixels, NULL);
+      zassert_mem_equal(Chunked, Expected, Out - Expected, "%u pixels", NumPixels);
+      for (u8 *Byte = Chunked + (Out - Expected);
+           Byte < Chunked + Chunks * TEST_CHUNK_PIXELS * STRIP_BYTES_PER_PIXEL; ++Byte)
+      {
+         zassert_equal(*Byte, 0, "%u pixels, byte %u", NumPixels, (u32)(Byte - Chunked));
+      }
+   }
+}
+
+void test_main(void)
+{
+   ztest_test_suite(strip_spi,
+                    ztest_unit_test(test_encode_byte),
+                    ztest_unit_test(test_encode_pixel_order),
+                    ztest_unit_test(test_chunks_match_frame));
+   ztest_run_test_suite(strip_spi);
+}